@@ -0,0 +1,1119 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Tests of the rewriting paths of the GRM manager which do not need a compiled
+// grammar; the rules are built directly.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <fst/arc.h>
+#include <fst/compact-fst.h>
+#include <fst/const-fst.h>
+#include <fst/equal.h>
+#include <fst/matcher.h>
+#include <fst/project.h>
+#include <fst/rmepsilon.h>
+#include <fst/shortest-path.h>
+#include <fst/string.h>
+#include <fst/extensions/far/sttable.h>
+#include <fst/symbol-table.h>
+#include <fst/vector-fst.h>
+#include <gtest/gtest.h>
+#include <thrax/algo/alphabet.h>
+#include <thrax/algo/bytetable.h>
+#include <thrax/algo/compact.h>
+#include <thrax/algo/nbest.h>
+#include <thrax/algo/sequential.h>
+#include <thrax/compat/thread-pool.h>
+#include <thrax/grm-manager.h>
+#include <thrax/indexed-far.h>
+#include <thrax/prepared-far.h>
+#include <thrax/rewrite-cache.h>
+#include <thrax/symbol-table-pool.h>
+
+namespace thrax {
+namespace {
+
+using ::fst::StdArc;
+using Manager = GrmManagerSpec<StdArc>;
+using Label = StdArc::Label;
+using Transducer = ::fst::VectorFst<StdArc>;
+
+// Returns a rule mapping each input string to its output string, with one path
+// for each pair.
+std::unique_ptr<Transducer> MakeRule(
+    const std::vector<std::pair<std::string, std::string>>& pairs) {
+  auto fst = std::make_unique<Transducer>();
+  const auto start = fst->AddState();
+  fst->SetStart(start);
+  for (const auto& [input, output] : pairs) {
+    auto state = start;
+    for (size_t i = 0; i < std::max(input.size(), output.size()); ++i) {
+      const Label ilabel =
+          i < input.size() ? static_cast<unsigned char>(input[i]) : 0;
+      const Label olabel =
+          i < output.size() ? static_cast<unsigned char>(output[i]) : 0;
+      const auto next = fst->AddState();
+      fst->AddArc(state, StdArc(ilabel, olabel, StdArc::Weight::One(), next));
+      state = next;
+    }
+    fst->SetFinal(state, StdArc::Weight::One());
+  }
+  return fst;
+}
+
+void LoadRules(
+    Manager* grm,
+    std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules) {
+  Manager::FstMap fsts;
+  for (auto& [name, fst] : rules) fsts.emplace(name, std::move(fst));
+  grm->LoadFstMap(std::move(fsts));
+}
+
+// A NUL byte compiles to an epsilon, which composition matches without moving
+// in the rule; walking a sequential rule must do the same.
+TEST(GrmManagerTest, SequentialRuleSkipsNulBytes) {
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  rules.emplace_back("RULE", MakeRule({{"ab", "x"}}));
+  LoadRules(&grm, std::move(rules));
+  ASSERT_TRUE(::fst::IsSequential(*grm.GetFst("RULE")));
+  std::string output;
+  ASSERT_TRUE(grm.RewriteBytes("RULE", std::string_view("a\0b", 3), &output));
+  EXPECT_EQ(output, "x");
+  std::vector<Label> labels;
+  ASSERT_TRUE(grm.RewriteLabels("RULE", {'a', 0, 'b'}, &labels));
+  EXPECT_EQ(labels, std::vector<Label>({'x'}));
+}
+
+// Statistics are switched on and off through SetOptions(), as for the other
+// options.
+TEST(GrmManagerTest, RuleStatsCountRewrites) {
+  Manager grm;
+  auto opts = grm.GetOptions();
+  opts.collect_rule_stats = true;
+  grm.SetOptions(opts);
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  // Both paths start with "a", so the rule is rewritten by composition.
+  rules.emplace_back("RULE", MakeRule({{"a", "x"}, {"ab", "yz"}}));
+  LoadRules(&grm, std::move(rules));
+  std::string output;
+  ASSERT_TRUE(grm.RewriteBytes("RULE", "ab", &output));
+  EXPECT_EQ(output, "yz");
+  EXPECT_FALSE(grm.RewriteBytes("RULE", "b", &output));
+  const auto stats = grm.GetRuleStats();
+  ASSERT_EQ(stats.count("RULE"), 1u);
+  const auto& rule_stats = stats.at("RULE");
+  EXPECT_EQ(rule_stats.calls, 2u);
+  EXPECT_EQ(rule_stats.failures, 1u);
+  EXPECT_EQ(rule_stats.output_size, 2u);
+  EXPECT_GE(rule_stats.compositions, 1u);
+  uint64_t bucketed = 0;
+  for (const auto count : rule_stats.latency_buckets) bucketed += count;
+  EXPECT_EQ(bucketed, 2u);
+  const auto text = grm.GetRuleStatsText();
+  EXPECT_NE(text.find("# TYPE thrax_rule_calls_total counter\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("thrax_rule_calls_total{rule=\"RULE\"} 2\n"),
+            std::string::npos);
+  EXPECT_NE(text.find("thrax_rule_failures_total{rule=\"RULE\"} 1\n"),
+            std::string::npos);
+  EXPECT_NE(
+      text.find("thrax_rule_latency_seconds_bucket{rule=\"RULE\",le=\"+Inf\"} "
+                "2\n"),
+      std::string::npos);
+  EXPECT_NE(text.find("thrax_rule_latency_seconds_count{rule=\"RULE\"} 2\n"),
+            std::string::npos);
+  grm.ResetRuleStats();
+  EXPECT_TRUE(grm.GetRuleStats().empty());
+  ASSERT_TRUE(grm.RewriteBytes("RULE", "ab", &output));
+  EXPECT_EQ(grm.GetRuleStats().at("RULE").calls, 1u);
+  opts.collect_rule_stats = false;
+  grm.SetOptions(opts);
+  ASSERT_TRUE(grm.RewriteBytes("RULE", "ab", &output));
+  EXPECT_TRUE(grm.GetRuleStats().empty());
+}
+
+TEST(GrmManagerTest, RuleStatsEscapesRuleNames) {
+  RuleStatsMap stats;
+  stats["A\"B\\C\nD"].calls = 1;
+  const auto text = RuleStatsToPrometheus(stats, "test");
+  EXPECT_NE(text.find("test_calls_total{rule=\"A\\\"B\\\\C\\nD\"} 1\n"),
+            std::string::npos);
+}
+
+// Relabeling a lattice for a lookahead rule reorders the arcs leaving its
+// branching states, which composition must not depend on.
+TEST(GrmManagerTest, LookAheadRuleRewritesBranchingLattice) {
+  Manager grm;
+  auto opts = grm.GetOptions();
+  opts.label_lookahead = true;
+  grm.SetOptions(opts);
+  // The longer outputs give the rule input epsilons, so it uses lookahead.
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  rules.emplace_back("RULE", MakeRule({{"ac", "xyz"}, {"b", "yz"}}));
+  LoadRules(&grm, std::move(rules));
+  // Paths "ab", "ac" and "b", in order of increasing weight; the rule only
+  // accepts the last two.
+  Transducer lattice;
+  lattice.AddStates(4);
+  lattice.SetStart(0);
+  lattice.AddArc(0, StdArc('a', 'a', StdArc::Weight::One(), 1));
+  lattice.AddArc(0, StdArc('b', 'b', StdArc::Weight(2), 3));
+  lattice.AddArc(1, StdArc('b', 'b', StdArc::Weight::One(), 3));
+  lattice.AddArc(1, StdArc('c', 'c', StdArc::Weight(1), 3));
+  lattice.SetFinal(3, StdArc::Weight::One());
+  std::string output;
+  ASSERT_TRUE(grm.RewriteBytes("RULE", lattice, &output));
+  EXPECT_EQ(output, "xyz");
+}
+
+// A boundary which may always continue into input not yet seen must not hold
+// up the stream past the segment size.
+TEST(GrmManagerTest, StreamWithoutBoundaryStaysBounded) {
+  static constexpr size_t kMaxSegmentBytes = 64;
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  // Rewrites any run of "a" to itself.
+  auto identity = std::make_unique<Transducer>();
+  identity->AddState();
+  identity->SetStart(0);
+  identity->AddArc(0, StdArc('a', 'a', StdArc::Weight::One(), 0));
+  identity->SetFinal(0, StdArc::Weight::One());
+  rules.emplace_back("IDENTITY", std::move(identity));
+  // Matches "a*b", so that each "a" may begin a boundary until a "b" comes.
+  auto boundary = std::make_unique<Transducer>();
+  boundary->AddStates(2);
+  boundary->SetStart(0);
+  boundary->AddArc(0, StdArc('a', 'a', StdArc::Weight::One(), 0));
+  boundary->AddArc(0, StdArc('b', 'b', StdArc::Weight::One(), 1));
+  boundary->SetFinal(1, StdArc::Weight::One());
+  rules.emplace_back("BOUNDARY", std::move(boundary));
+  LoadRules(&grm, std::move(rules));
+  StreamRewriteOptions opts;
+  opts.boundary_rule = "BOUNDARY";
+  opts.max_segment_bytes = kMaxSegmentBytes;
+  std::string output;
+  size_t max_emitted = 0;
+  auto rewriter =
+      grm.MakeStreamRewriter("IDENTITY", opts, [&](std::string_view segment) {
+        max_emitted = std::max(max_emitted, segment.size());
+        output.append(segment);
+        return true;
+      });
+  ASSERT_NE(rewriter, nullptr);
+  const std::string chunk(100, 'a');
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(rewriter->Feed(chunk));
+    // Only what does not fill a segment may be held back.
+    EXPECT_LT((i + 1) * chunk.size() - output.size(), kMaxSegmentBytes);
+  }
+  ASSERT_TRUE(rewriter->Finish());
+  EXPECT_EQ(output, std::string(100 * chunk.size(), 'a'));
+  EXPECT_LE(max_emitted, kMaxSegmentBytes);
+}
+
+// An archive whose manifest fails its checksum is loaded as an ordinary one,
+// but its artifacts must still not be taken for rules.
+TEST(GrmManagerTest, DamagedManifestHidesArtifacts) {
+  const std::string rule_key = "RULE";
+  const std::string lookahead_key = kPreparedLookAheadPrefix + rule_key;
+  PreparedFarManifest manifest;
+  manifest.rules.push_back({rule_key, 0, /*lookahead=*/true});
+  auto text = manifest.Serialize();
+  // Corrupts the last digit of the checksum.
+  auto& digit = text[text.size() - 2];
+  digit = digit == '0' ? '1' : '0';
+  const auto filename = ::testing::TempDir() + "/damaged-manifest.far";
+  {
+    std::unique_ptr<::fst::FarWriter<StdArc>> writer(
+        ::fst::STTableFarWriter<StdArc>::Create(filename));
+    ASSERT_NE(writer, nullptr);
+    // STTable keys must be added in order.
+    writer->Add(lookahead_key, *MakeRule({{"ab", "xy"}}));
+    writer->Add(kPreparedFarManifestKey, *MakeRule({{text, text}}));
+    writer->Add(rule_key, *MakeRule({{"ab", "xy"}}));
+  }
+  for (const bool lazy_load : {false, true}) {
+    SCOPED_TRACE(lazy_load ? "lazy" : "eager");
+    Manager grm;
+    auto opts = grm.GetOptions();
+    opts.lazy_load = lazy_load;
+    grm.SetOptions(opts);
+    ASSERT_TRUE(grm.LoadArchive(filename));
+    EXPECT_EQ(grm.GetFst(lookahead_key), nullptr);
+    EXPECT_EQ(grm.GetFst(kPreparedFarManifestKey), nullptr);
+    const auto& fsts = std::as_const(grm).GetFstMap();
+    EXPECT_EQ(fsts.size(), 1u);
+    EXPECT_EQ(fsts.count(rule_key), 1u);
+    std::string output;
+    ASSERT_TRUE(grm.RewriteBytes(rule_key, "ab", &output));
+    EXPECT_EQ(output, "xy");
+  }
+}
+
+// Returns a byte symbol table, as exported with --save_symbols.
+std::unique_ptr<::fst::SymbolTable> MakeByteSymbols() {
+  auto syms = std::make_unique<::fst::SymbolTable>("**Byte symbols");
+  syms->AddSymbol("<epsilon>", 0);
+  for (Label label = 1; label < 256; ++label) {
+    syms->AddSymbol("byte" + std::to_string(label), label);
+  }
+  return syms;
+}
+
+// Equal tables are pooled once, for as long as a set of rules refers to them.
+TEST(SymbolTablePoolTest, InternsEqualTablesOnce) {
+  SymbolTablePool pool;
+  auto refs = std::make_unique<SymbolTableRefs>();
+  auto first = MakeRule({{"a", "x"}});
+  auto second = MakeRule({{"b", "y"}});
+  const auto syms = MakeByteSymbols();
+  first->SetInputSymbols(syms.get());
+  first->SetOutputSymbols(syms.get());
+  second->SetInputSymbols(syms.get());
+  pool.Intern(first.get(), refs.get());
+  pool.Intern(second.get(), refs.get());
+  EXPECT_EQ(pool.Size(), 1u);
+  EXPECT_EQ(refs->Size(), 1u);
+  EXPECT_EQ(first->InputSymbols()->LabeledCheckSum(),
+            syms->LabeledCheckSum());
+  // Another set of rules refers to the same tables.
+  SymbolTableRefs copied;
+  copied.Add(*refs);
+  refs.reset();
+  EXPECT_EQ(pool.Size(), 1u);
+  EXPECT_EQ(copied.Size(), 1u);
+  // A different table is pooled separately.
+  auto other = MakeByteSymbols();
+  other->AddSymbol("extra", 256);
+  SymbolTableRefs other_refs;
+  second->SetOutputSymbols(other.get());
+  pool.Intern(second.get(), &other_refs);
+  EXPECT_EQ(pool.Size(), 2u);
+  EXPECT_EQ(other_refs.Size(), 2u);
+}
+
+// Rules read lazily are interned as they are read, and keep their tables
+// across the generations which share them.
+TEST(GrmManagerTest, InternsSymbolsOfLazilyLoadedRules) {
+  const auto syms = MakeByteSymbols();
+  const auto filename = ::testing::TempDir() + "/interned-symbols.far";
+  {
+    std::unique_ptr<::fst::FarWriter<StdArc>> writer(
+        ::fst::STTableFarWriter<StdArc>::Create(filename));
+    ASSERT_NE(writer, nullptr);
+    for (const auto& [name, output] :
+         std::vector<std::pair<std::string, std::string>>{{"FIRST", "x"},
+                                                          {"SECOND", "y"}}) {
+      auto rule = MakeRule({{"a", output}});
+      rule->SetInputSymbols(syms.get());
+      rule->SetOutputSymbols(syms.get());
+      writer->Add(name, *rule);
+    }
+  }
+  for (const bool lazy_load : {false, true}) {
+    SCOPED_TRACE(lazy_load ? "lazy" : "eager");
+    Manager grm;
+    auto opts = grm.GetOptions();
+    EXPECT_FALSE(opts.intern_symbols);
+    opts.intern_symbols = true;
+    opts.lazy_load = lazy_load;
+    grm.SetOptions(opts);
+    ASSERT_TRUE(grm.LoadArchive(filename));
+    std::string output;
+    ASSERT_TRUE(grm.RewriteBytes("FIRST", "a", &output));
+    EXPECT_EQ(output, "x");
+    const auto* rule = grm.GetFst("FIRST");
+    ASSERT_NE(rule, nullptr);
+    ASSERT_NE(rule->InputSymbols(), nullptr);
+    EXPECT_EQ(rule->InputSymbols()->LabeledCheckSum(),
+              syms->LabeledCheckSum());
+    // Replacing a rule publishes a generation sharing the other's tables.
+    ASSERT_TRUE(grm.SetFst("FIRST", *MakeRule({{"a", "z"}})));
+    ASSERT_TRUE(grm.RewriteBytes("FIRST", "a", &output));
+    EXPECT_EQ(output, "z");
+    ASSERT_TRUE(grm.RewriteBytes("SECOND", "a", &output));
+    EXPECT_EQ(output, "y");
+    EXPECT_EQ(grm.GetFst("SECOND")->InputSymbols()->LabeledCheckSum(),
+              syms->LabeledCheckSum());
+  }
+}
+
+// Rules exported with --mappable_far are aligned ConstFsts, which the indexed
+// reader maps straight from the archive.
+TEST(IndexedFarTest, MappableExportRoundTrips) {
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  rules.emplace_back("FIRST", MakeRule({{"ab", "x"}}));
+  rules.emplace_back("SECOND", MakeRule({{"b", "yz"}, {"a", "w"}}));
+  LoadRules(&grm, std::move(rules));
+  const auto saved_outdir = FST_FLAGS_outdir;
+  const auto saved_mappable_far = FST_FLAGS_mappable_far;
+  FST_FLAGS_outdir = ::testing::TempDir();
+  FST_FLAGS_mappable_far = true;
+  grm.ExportFar("mappable.far");
+  FST_FLAGS_outdir = saved_outdir;
+  FST_FLAGS_mappable_far = saved_mappable_far;
+  const auto filename = ::testing::TempDir() + "/mappable.far";
+  const auto reader =
+      IndexedFarReader<StdArc>::Open(filename, ::fst::FstReadOptions::MAP);
+  ASSERT_NE(reader, nullptr);
+  ASSERT_EQ(reader->NumEntries(), 2u);
+  EXPECT_EQ(reader->Key(0), "FIRST");
+  EXPECT_EQ(reader->Key(1), "SECOND");
+  EXPECT_EQ(reader->Find("SECOND"), 1u);
+  EXPECT_EQ(reader->Find("THIRD"), 2u);
+  for (size_t i = 0; i < reader->NumEntries(); ++i) {
+    const auto fst = reader->ReadFstAs<::fst::ConstFst<StdArc>>(i);
+    ASSERT_NE(fst, nullptr);
+    EXPECT_EQ(fst->NumStates(), grm.GetFst(reader->Key(i))->NumStates());
+    EXPECT_EQ(fst->Properties(::fst::kILabelSorted, false),
+              ::fst::kILabelSorted);
+  }
+  Manager mapped;
+  auto opts = mapped.GetOptions();
+  opts.map_archive = true;
+  mapped.SetOptions(opts);
+  ASSERT_TRUE(mapped.LoadArchive(filename));
+  std::string output;
+  ASSERT_TRUE(mapped.RewriteBytes("FIRST", "ab", &output));
+  EXPECT_EQ(output, "x");
+  ASSERT_TRUE(mapped.RewriteBytes("SECOND", "b", &output));
+  EXPECT_EQ(output, "yz");
+}
+
+// The number of entries at the end of an archive is checked against its size
+// before anything is allocated for them.
+TEST(IndexedFarTest, RejectsOversizedIndex) {
+  const auto filename = ::testing::TempDir() + "/oversized-index.far";
+  {
+    std::ofstream strm(filename, std::ios_base::out | std::ios_base::binary);
+    ::fst::WriteType(strm, ::fst::kSTTableMagicNumber);
+    ::fst::WriteType(strm, ::fst::kSTTableFileVersion);
+    ::fst::WriteType(strm, std::vector<int64_t>{8});
+    ::fst::WriteType(strm, static_cast<int64_t>(1) << 60);
+  }
+  EXPECT_EQ(IndexedFarReader<StdArc>::Open(filename), nullptr);
+  // A position past the entries is rejected too.
+  {
+    std::ofstream strm(filename, std::ios_base::out | std::ios_base::binary);
+    ::fst::WriteType(strm, ::fst::kSTTableMagicNumber);
+    ::fst::WriteType(strm, ::fst::kSTTableFileVersion);
+    ::fst::WriteType(strm, std::vector<int64_t>{1 << 20});
+    ::fst::WriteType(strm, static_cast<int64_t>(1));
+  }
+  EXPECT_EQ(IndexedFarReader<StdArc>::Open(filename), nullptr);
+}
+
+// The element sizes the compact encodings are chosen by.
+TEST(CompactCopyTest, ElementSizes) {
+  EXPECT_EQ(sizeof(StdArc), 16u);
+  EXPECT_EQ(sizeof(::fst::UnweightedCompactor<StdArc>::Element), 12u);
+  EXPECT_EQ(sizeof(::fst::UnweightedAcceptorCompactor<StdArc>::Element), 8u);
+  EXPECT_EQ(sizeof(::fst::StringCompactor<StdArc>::Element), 4u);
+}
+
+TEST(CompactCopyTest, ChoosesSmallestEncoding) {
+  const auto rule = MakeRule({{"abc", "x"}, {"abd", "yz"}});
+  size_t bytes = 0;
+  const auto compact = ::fst::CompactCopy(*rule, &bytes);
+  ASSERT_NE(compact, nullptr);
+  EXPECT_EQ(compact->Type(), "compact_unweighted");
+  // Six arcs and two final weights, and an offset for each of the seven
+  // states and one past the last.
+  EXPECT_EQ(bytes, 8 * 12 + 8 * 4);
+  EXPECT_LT(bytes, ::fst::VectorFstBytes(*rule));
+  EXPECT_TRUE(::fst::Equal(*compact, *rule));
+  Transducer string;
+  string.AddStates(3);
+  string.SetStart(0);
+  string.AddArc(0, StdArc('a', 'a', StdArc::Weight::One(), 1));
+  string.AddArc(1, StdArc('b', 'b', StdArc::Weight::One(), 2));
+  string.SetFinal(2, StdArc::Weight::One());
+  const auto compact_string = ::fst::CompactCopy(string, &bytes);
+  ASSERT_NE(compact_string, nullptr);
+  EXPECT_EQ(compact_string->Type(), "compact_string");
+  EXPECT_EQ(bytes, 3 * 4);
+  // Nothing is built unless it is smaller than the bound.
+  EXPECT_EQ(::fst::CompactCopy(string, &bytes, /*max_bytes=*/12), nullptr);
+  EXPECT_EQ(bytes, 12u);
+}
+
+// Compacted rules rewrite as their heap forms do.
+TEST(GrmManagerTest, CompactRulesRewriteAsBefore) {
+  Manager grm;
+  auto opts = grm.GetOptions();
+  opts.compact_rules = true;
+  grm.SetOptions(opts);
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  rules.emplace_back("RULE", MakeRule({{"abc", "x"}, {"abd", "yz"}}));
+  LoadRules(&grm, std::move(rules));
+  EXPECT_EQ(grm.GetFst("RULE")->Type(), "compact_unweighted");
+  const auto stats = grm.GetGeneration()->GetCompactionStats();
+  EXPECT_EQ(stats.num_rules, 1u);
+  EXPECT_EQ(stats.num_compacted, 1u);
+  EXPECT_LT(stats.bytes_after, stats.bytes_before);
+  std::string output;
+  ASSERT_TRUE(grm.RewriteBytes("RULE", "abd", &output));
+  EXPECT_EQ(output, "yz");
+  EXPECT_FALSE(grm.RewriteBytes("RULE", "ab", &output));
+}
+
+// Returns the arcs matched for the label at the state, as (ilabel, olabel,
+// nextstate) triples.
+template <class M>
+std::vector<std::tuple<Label, Label, StdArc::StateId>> Matches(
+    M* matcher, StdArc::StateId state, Label label) {
+  std::vector<std::tuple<Label, Label, StdArc::StateId>> matches;
+  matcher->SetState(state);
+  if (!matcher->Find(label)) return matches;
+  for (; !matcher->Done(); matcher->Next()) {
+    const auto& arc = matcher->Value();
+    matches.emplace_back(arc.ilabel, arc.olabel, arc.nextstate);
+  }
+  return matches;
+}
+
+// The byte tables only change how the arcs are found, including the implicit
+// epsilon loop and the labels beyond the byte range, which are searched.
+TEST(ByteTableMatcherTest, MatchesAsSortedMatcher) {
+  Transducer fst;
+  fst.AddStates(3);
+  fst.SetStart(0);
+  for (const Label label : {0, 0, 1, 'a', 'a', 'b', 255, 256, 300, 300}) {
+    fst.AddArc(0, StdArc(label, 'x', StdArc::Weight::One(), 1));
+  }
+  fst.AddArc(1, StdArc('a', 'y', StdArc::Weight::One(), 2));
+  fst.SetFinal(2, StdArc::Weight::One());
+  ::fst::ArcSort(&fst, ::fst::ILabelCompare<StdArc>());
+  // State 0 has a table; state 1, with fewer arcs, is searched.
+  const ::fst::ByteTables<StdArc> tables(fst, /*min_arcs=*/2);
+  ASSERT_EQ(tables.NumTables(), 1u);
+  ::fst::SortedMatcher<::fst::Fst<StdArc>> sorted(&fst, ::fst::MATCH_INPUT);
+  ::fst::ByteTableMatcher<::fst::Fst<StdArc>> byte_table(&fst, &tables);
+  EXPECT_EQ(byte_table.Type(true), ::fst::MATCH_INPUT);
+  std::unique_ptr<::fst::ByteTableMatcher<::fst::Fst<StdArc>>> copy(
+      byte_table.Copy());
+  for (StdArc::StateId state = 0; state < fst.NumStates(); ++state) {
+    for (Label label = ::fst::kNoLabel; label <= 301; ++label) {
+      SCOPED_TRACE(label);
+      const auto expected = Matches(&sorted, state, label);
+      EXPECT_EQ(Matches(&byte_table, state, label), expected);
+      EXPECT_EQ(Matches(copy.get(), state, label), expected);
+    }
+  }
+}
+
+// Rules with byte tables rewrite as they do without.
+TEST(GrmManagerTest, ByteTableRuleRewritesAsBefore) {
+  std::vector<std::pair<std::string, std::string>> pairs;
+  for (int byte = 1; byte < 256; ++byte) {
+    pairs.emplace_back(std::string(1, static_cast<char>(byte)) + "b", "x");
+  }
+  for (const size_t min_arcs : {0, 2}) {
+    SCOPED_TRACE(min_arcs);
+    Manager grm;
+    auto opts = grm.GetOptions();
+    opts.byte_table_min_arcs = min_arcs;
+    grm.SetOptions(opts);
+    std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+    auto rule = MakeRule(pairs);
+    // An input epsilon, which the rewrite avoids, and a label beyond the byte
+    // range.
+    rule->AddArc(0, StdArc(0, 'e', StdArc::Weight(1), 0));
+    rule->AddArc(0, StdArc(300, 'z', StdArc::Weight::One(), 0));
+    rules.emplace_back("RULE", std::move(rule));
+    LoadRules(&grm, std::move(rules));
+    std::string output;
+    ASSERT_TRUE(grm.RewriteBytes("RULE", std::string("\xff" "b"), &output));
+    EXPECT_EQ(output, "x");
+    std::vector<Label> labels;
+    ASSERT_TRUE(grm.RewriteLabels("RULE", {300, 'a', 'b'}, &labels));
+    EXPECT_EQ(labels, std::vector<Label>({'z', 'x'}));
+  }
+}
+
+// Precomposing the rules of a cascade does not change its rewrites, whether or
+// not the lattices are pruned between stages (which precomposition skips).
+TEST(RuleCascadeTest, PrecomposedMatchesStageByStage) {
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  // The rules insert and delete symbols, so composition meets epsilons on
+  // both sides.
+  rules.emplace_back("FIRST", MakeRule({{"ab", "c"}, {"a", "cc"}}));
+  rules.emplace_back("SECOND", MakeRule({{"c", "xy"}, {"cc", "z"}}));
+  rules.emplace_back("THIRD", MakeRule({{"xy", "1"}, {"z", "23"}}));
+  LoadRules(&grm, std::move(rules));
+  const std::vector<std::string> defs = {"FIRST", "SECOND", "THIRD"};
+  for (const int32_t max_paths : {-1, 1}) {
+    SCOPED_TRACE(max_paths);
+    RuleCascadeOptions opts;
+    opts.max_paths = max_paths;
+    RuleCascade<StdArc> stages(opts);
+    ASSERT_TRUE(stages.InitFromDefs(&grm, defs));
+    opts.precompose = true;
+    opts.precompose_at_init = true;
+    RuleCascade<StdArc> precomposed(opts);
+    ASSERT_TRUE(precomposed.InitFromDefs(&grm, defs));
+    for (const std::string input : {"ab", "a", "b", ""}) {
+      SCOPED_TRACE(input);
+      std::string expected;
+      std::string output;
+      const bool succeeded = stages.RewriteBytes(input, &expected);
+      EXPECT_EQ(precomposed.RewriteBytes(input, &output), succeeded);
+      if (succeeded) EXPECT_EQ(output, expected);
+    }
+    std::string output;
+    ASSERT_TRUE(precomposed.RewriteBytes("ab", &output));
+    EXPECT_EQ(output, "1");
+    ASSERT_TRUE(precomposed.RewriteBytes("a", &output));
+    EXPECT_EQ(output, "23");
+  }
+}
+
+TEST(RewriteCacheTest, HitsMissesAndEvicts) {
+  // A single shard, so that eviction order is deterministic.
+  RewriteCache cache(/*max_bytes=*/1 << 10, /*num_shards=*/1);
+  std::string output;
+  bool success = false;
+  EXPECT_FALSE(cache.Lookup("a", &output, &success));
+  cache.Insert("a", "x", /*success=*/true);
+  cache.Insert("b", "", /*success=*/false);
+  ASSERT_TRUE(cache.Lookup("a", &output, &success));
+  EXPECT_TRUE(success);
+  EXPECT_EQ(output, "x");
+  // Failures are cached too, and leave the output alone.
+  ASSERT_TRUE(cache.Lookup("b", &output, &success));
+  EXPECT_FALSE(success);
+  EXPECT_EQ(output, "x");
+  auto stats = cache.GetStats();
+  EXPECT_EQ(stats.hits, 2u);
+  EXPECT_EQ(stats.misses, 1u);
+  EXPECT_EQ(stats.entries, 2u);
+  // Filling the shard evicts the least recently used entries first; "a" was
+  // used before "b".
+  const std::string long_output(256, 'y');
+  for (int i = 0; cache.GetStats().evictions < 2; ++i) {
+    cache.Insert("long" + std::to_string(i), long_output, /*success=*/true);
+  }
+  EXPECT_FALSE(cache.Lookup("a", &output, &success));
+  EXPECT_FALSE(cache.Lookup("b", &output, &success));
+  stats = cache.GetStats();
+  EXPECT_LE(stats.bytes, 1u << 10);
+  // Entries larger than the shard are not cached.
+  cache.Insert("huge", std::string(2 << 10, 'z'), /*success=*/true);
+  EXPECT_FALSE(cache.Lookup("huge", &output, &success));
+  cache.Clear();
+  EXPECT_EQ(cache.GetStats().entries, 0u);
+  EXPECT_EQ(cache.GetStats().bytes, 0u);
+}
+
+// Cached rewrites give the results of uncached ones, and replacing a rule
+// invalidates them.
+TEST(GrmManagerTest, CachedRewritesMatchUncached) {
+  Manager uncached;
+  Manager cached;
+  auto opts = cached.GetOptions();
+  opts.rewrite_cache_bytes = 1 << 20;
+  cached.SetOptions(opts);
+  ASSERT_NE(cached.GetRewriteCache(), nullptr);
+  for (auto* grm : {&uncached, &cached}) {
+    std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+    rules.emplace_back("RULE", MakeRule({{"a", "x"}, {"ab", "yz"}}));
+    LoadRules(grm, std::move(rules));
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    for (const std::string input : {"a", "ab", "b"}) {
+      SCOPED_TRACE(input);
+      std::string expected;
+      std::string output;
+      const bool succeeded = uncached.RewriteBytes("RULE", input, &expected);
+      EXPECT_EQ(cached.RewriteBytes("RULE", input, &output), succeeded);
+      if (succeeded) EXPECT_EQ(output, expected);
+    }
+  }
+  auto stats = cached.GetRewriteCache()->GetStats();
+  EXPECT_EQ(stats.misses, 3u);
+  EXPECT_EQ(stats.hits, 3u);
+  EXPECT_EQ(stats.entries, 3u);
+  ASSERT_TRUE(cached.SetFst("RULE", *MakeRule({{"a", "w"}})));
+  EXPECT_EQ(cached.GetRewriteCache()->GetStats().entries, 0u);
+  std::string output;
+  ASSERT_TRUE(cached.RewriteBytes("RULE", "a", &output));
+  EXPECT_EQ(output, "w");
+  EXPECT_FALSE(cached.RewriteBytes("RULE", "ab", &output));
+  EXPECT_EQ(cached.GetRewriteCache()->GetStats().hits, 3u);
+}
+
+// Batches give the results of serial rewrites, in order, whether or not they
+// are spread over a pool.
+TEST(GrmManagerTest, RewriteBatchMatchesSerial) {
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  rules.emplace_back("FIRST", MakeRule({{"a", "x"}, {"ab", "yz"}}));
+  rules.emplace_back("SECOND", MakeRule({{"x", "1"}, {"yz", ""}}));
+  LoadRules(&grm, std::move(rules));
+  RuleCascade<StdArc> cascade;
+  ASSERT_TRUE(cascade.InitFromDefs(&grm, {"FIRST", "SECOND"}));
+  std::vector<std::string> strings;
+  for (int i = 0; i < 100; ++i) strings.push_back(i % 3 ? "ab" : "a");
+  strings.push_back("b");
+  strings.push_back("");
+  const std::vector<std::string_view> inputs(strings.begin(), strings.end());
+  ThreadPool pool(4);
+  for (auto* batch_pool : {static_cast<ThreadPool*>(nullptr), &pool}) {
+    SCOPED_TRACE(batch_pool ? "pool" : "serial");
+    std::vector<std::string> outputs;
+    std::vector<bool> succeeded;
+    const auto num_succeeded =
+        grm.RewriteBatch("FIRST", inputs, &outputs, &succeeded, batch_pool);
+    std::vector<std::string> cascade_outputs;
+    std::vector<bool> cascade_succeeded;
+    const auto cascade_num_succeeded = cascade.RewriteBatch(
+        inputs, &cascade_outputs, &cascade_succeeded, batch_pool);
+    ASSERT_EQ(outputs.size(), inputs.size());
+    ASSERT_EQ(succeeded.size(), inputs.size());
+    ASSERT_EQ(cascade_outputs.size(), inputs.size());
+    ASSERT_EQ(cascade_succeeded.size(), inputs.size());
+    size_t expected_succeeded = 0;
+    size_t expected_cascade_succeeded = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      SCOPED_TRACE(i);
+      std::string output;
+      const bool expected = grm.RewriteBytes("FIRST", inputs[i], &output);
+      EXPECT_EQ(succeeded[i], expected);
+      EXPECT_EQ(outputs[i], expected ? output : "");
+      expected_succeeded += expected;
+      const bool cascade_expected = cascade.RewriteBytes(inputs[i], &output);
+      EXPECT_EQ(cascade_succeeded[i], cascade_expected);
+      EXPECT_EQ(cascade_outputs[i], cascade_expected ? output : "");
+      expected_cascade_succeeded += cascade_expected;
+    }
+    EXPECT_EQ(num_succeeded, expected_succeeded);
+    EXPECT_EQ(cascade_num_succeeded, expected_cascade_succeeded);
+  }
+  // A missing rule fails the whole batch.
+  std::vector<std::string> outputs;
+  EXPECT_EQ(grm.RewriteBatch("MISSING", inputs, &outputs), 0u);
+  EXPECT_EQ(outputs.size(), inputs.size());
+}
+
+// Returns the output strings of an acyclic FST, with their weights, sorted by
+// weight.
+std::vector<std::pair<StdArc::Weight, std::string>> PathStrings(
+    const Transducer& fst) {
+  std::vector<std::pair<StdArc::Weight, std::string>> paths;
+  std::vector<std::tuple<StdArc::StateId, StdArc::Weight, std::string>> stack;
+  if (fst.Start() != ::fst::kNoStateId) {
+    stack.emplace_back(fst.Start(), StdArc::Weight::One(), "");
+  }
+  while (!stack.empty()) {
+    const auto [state, weight, path] = stack.back();
+    stack.pop_back();
+    const auto final_weight = fst.Final(state);
+    if (final_weight != StdArc::Weight::Zero()) {
+      paths.emplace_back(::fst::Times(weight, final_weight), path);
+    }
+    for (::fst::ArcIterator<Transducer> aiter(fst, state); !aiter.Done();
+         aiter.Next()) {
+      const auto& arc = aiter.Value();
+      auto next_path = path;
+      if (arc.olabel) next_path.push_back(arc.olabel);
+      stack.emplace_back(arc.nextstate, ::fst::Times(weight, arc.weight),
+                         next_path);
+    }
+  }
+  std::stable_sort(paths.begin(), paths.end(),
+                   [](const auto& x, const auto& y) {
+                     return x.first.Value() < y.first.Value();
+                   });
+  return paths;
+}
+
+// NBestStrings() finds the strings ShortestPath() with unique = true does, on
+// a lattice with tied strings, a string on several paths, and epsilon cycles.
+TEST(NBestStringsTest, MatchesUniqueShortestPath) {
+  Transducer fst;
+  fst.AddStates(4);
+  fst.SetStart(0);
+  fst.AddArc(0, StdArc('a', 'x', StdArc::Weight(1), 1));
+  fst.AddArc(0, StdArc('a', 'y', StdArc::Weight(1), 1));
+  fst.AddArc(0, StdArc('a', 'x', StdArc::Weight(4), 1));
+  fst.AddArc(0, StdArc('a', 'z', StdArc::Weight(2), 2));
+  // An epsilon cycle, and a loop adding to the output.
+  fst.AddArc(1, StdArc(0, 0, StdArc::Weight(0.5), 3));
+  fst.AddArc(3, StdArc(0, 0, StdArc::Weight(0.5), 1));
+  fst.AddArc(2, StdArc(0, 'w', StdArc::Weight(3), 2));
+  fst.SetFinal(1, StdArc::Weight::One());
+  fst.SetFinal(2, StdArc::Weight::One());
+  Transducer projected(fst);
+  ::fst::Project(&projected, ::fst::ProjectType::OUTPUT);
+  ::fst::RmEpsilon(&projected);
+  for (const size_t n : {1, 2, 3, 5}) {
+    SCOPED_TRACE(n);
+    Transducer shortest;
+    ::fst::ShortestPath(projected, &shortest, n, /*unique=*/true);
+    const auto expected = PathStrings(shortest);
+    std::vector<std::string> outputs;
+    std::vector<StdArc::Weight> weights;
+    ASSERT_TRUE(::fst::NBestStrings(fst, n, &outputs, &weights));
+    ASSERT_EQ(outputs.size(), expected.size());
+    ASSERT_EQ(weights.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+      EXPECT_TRUE(::fst::ApproxEqual(weights[i], expected[i].first));
+    }
+    // Tied strings come in no particular order, and which of them make the
+    // cut is arbitrary; the others must match exactly.
+    for (size_t i = 2; i < expected.size(); ++i) {
+      EXPECT_EQ(outputs[i], expected[i].second);
+    }
+  }
+  std::vector<std::string> outputs;
+  ASSERT_TRUE(::fst::NBestStrings(fst, 5, &outputs));
+  std::sort(outputs.begin(), outputs.begin() + 2);
+  EXPECT_EQ(outputs,
+            std::vector<std::string>({"x", "y", "z", "zw", "zww"}));
+  // Through the manager, the lattice is the rule's composition with the
+  // input.
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  rules.emplace_back("RULE", std::make_unique<Transducer>(fst));
+  LoadRules(&grm, std::move(rules));
+  std::vector<StdArc::Weight> weights;
+  ASSERT_TRUE(grm.RewriteNBest("RULE", "a", 5, &outputs, &weights));
+  std::sort(outputs.begin(), outputs.begin() + 2);
+  EXPECT_EQ(outputs,
+            std::vector<std::string>({"x", "y", "z", "zw", "zww"}));
+  EXPECT_FALSE(grm.RewriteNBest("RULE", "b", 5, &outputs, &weights));
+  EXPECT_TRUE(outputs.empty());
+}
+
+// Lazily loaded rules rewrite as eagerly loaded ones do. Preloaded rules are
+// read by LoadArchive(), and the others only when first used, which the
+// archive's removal reveals.
+TEST(GrmManagerTest, LazyLoadingReadsPreloadedRulesUpFront) {
+  const auto filename = ::testing::TempDir() + "/lazy.far";
+  {
+    const auto writer = IndexedFarWriter<StdArc>::Create(filename);
+    ASSERT_NE(writer, nullptr);
+    ASSERT_TRUE(writer->Add("FIRST", *MakeRule({{"a", "x"}, {"ab", "yz"}})));
+    ASSERT_TRUE(writer->Add("SECOND", *MakeRule({{"b", "w"}})));
+    ASSERT_TRUE(writer->Add("THIRD", *MakeRule({{"c", "v"}})));
+  }
+  Manager eager;
+  ASSERT_TRUE(eager.LoadArchive(filename));
+  Manager lazy;
+  auto opts = lazy.GetOptions();
+  opts.lazy_load = true;
+  opts.preload_rules = {"MISSING"};
+  lazy.SetOptions(opts);
+  // A missing preloaded rule fails the load.
+  EXPECT_FALSE(lazy.LoadArchive(filename));
+  opts.preload_rules = {"FIRST"};
+  lazy.SetOptions(opts);
+  ASSERT_TRUE(lazy.LoadArchive(filename));
+  for (const std::string input : {"a", "ab", "b"}) {
+    SCOPED_TRACE(input);
+    std::string expected;
+    std::string output;
+    const bool succeeded = eager.RewriteBytes("FIRST", input, &expected);
+    EXPECT_EQ(lazy.RewriteBytes("FIRST", input, &output), succeeded);
+    if (succeeded) EXPECT_EQ(output, expected);
+  }
+  std::string output;
+  ASSERT_TRUE(lazy.RewriteBytes("SECOND", "b", &output));
+  EXPECT_EQ(output, "w");
+  ASSERT_EQ(std::remove(filename.c_str()), 0);
+  ASSERT_TRUE(lazy.RewriteBytes("FIRST", "a", &output));
+  EXPECT_EQ(output, "x");
+  ASSERT_TRUE(lazy.RewriteBytes("SECOND", "b", &output));
+  EXPECT_EQ(output, "w");
+  // Never read, and now unreadable.
+  EXPECT_EQ(lazy.GetFst("THIRD"), nullptr);
+  EXPECT_FALSE(lazy.RewriteBytes("THIRD", "c", &output));
+}
+
+// Returns a rule mapping each input string of labels to its output string,
+// with one path for each pair.
+std::unique_ptr<Transducer> MakeLabelRule(
+    const std::vector<std::pair<std::u32string, std::u32string>>& pairs) {
+  auto fst = std::make_unique<Transducer>();
+  const auto start = fst->AddState();
+  fst->SetStart(start);
+  for (const auto& [input, output] : pairs) {
+    auto state = start;
+    for (size_t i = 0; i < std::max(input.size(), output.size()); ++i) {
+      const Label ilabel = i < input.size() ? input[i] : 0;
+      const Label olabel = i < output.size() ? output[i] : 0;
+      const auto next = fst->AddState();
+      fst->AddArc(state, StdArc(ilabel, olabel, StdArc::Weight::One(), next));
+      state = next;
+    }
+    fst->SetFinal(state, StdArc::Weight::One());
+  }
+  return fst;
+}
+
+// Rewrites the input, compiled into an FST, by composition, storing the
+// output labels of the best path.
+bool ComposeLabels(const Manager& grm, std::string_view rule,
+                   const std::u32string& input, std::u32string* output) {
+  Transducer input_fst;
+  input_fst.AddStates(input.size() + 1);
+  input_fst.SetStart(0);
+  for (size_t i = 0; i < input.size(); ++i) {
+    input_fst.AddArc(i, StdArc(input[i], input[i], StdArc::Weight::One(),
+                               i + 1));
+  }
+  input_fst.SetFinal(input.size(), StdArc::Weight::One());
+  Transducer lattice;
+  if (!grm.Rewrite(rule, input_fst, &lattice)) return false;
+  Transducer path;
+  ::fst::ShortestPath(lattice, &path);
+  output->clear();
+  if (path.Start() == ::fst::kNoStateId) return false;
+  for (auto state = path.Start(); path.NumArcs(state) > 0;) {
+    const ::fst::ArcIterator<Transducer> aiter(path, state);
+    if (aiter.Value().olabel) output->push_back(aiter.Value().olabel);
+    state = aiter.Value().nextstate;
+  }
+  return true;
+}
+
+// The label, codepoint and UTF-8 entry points give the results of composing
+// the rule with a compiled input, for sequential rules as for others.
+TEST(GrmManagerTest, CodepointRewritesMatchComposition) {
+  Manager grm;
+  std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+  // Both paths start with alpha, so this one is rewritten by composition.
+  rules.emplace_back("GREEK", MakeLabelRule({{U"\u03b1\u03b2", U"ab"},
+                                             {U"\u03b1", U"\u03a9"}}));
+  rules.emplace_back("EMOJI",
+                     MakeLabelRule({{U"\U0001f600", U"x\U0001f601"},
+                                    {U"a", {0xD800}}}));
+  LoadRules(&grm, std::move(rules));
+  ASSERT_FALSE(::fst::IsSequential(*grm.GetFst("GREEK")));
+  ASSERT_TRUE(::fst::IsSequential(*grm.GetFst("EMOJI")));
+  for (const auto& [rule, input] :
+       std::vector<std::pair<std::string, std::u32string>>{
+           {"GREEK", U"\u03b1\u03b2"},
+           {"GREEK", U"\u03b1"},
+           {"GREEK", U"\u03b2"},
+           {"EMOJI", U"\U0001f600"},
+           {"EMOJI", U"\U0001f600\U0001f600"}}) {
+    SCOPED_TRACE(rule);
+    std::u32string expected;
+    const bool succeeded = ComposeLabels(grm, rule, input, &expected);
+    std::u32string output;
+    EXPECT_EQ(grm.RewriteCodepoints(rule, input, &output), succeeded);
+    if (succeeded) EXPECT_EQ(output, expected);
+    std::vector<Label> labels;
+    EXPECT_EQ(grm.RewriteLabels(rule,
+                                std::vector<Label>(input.begin(), input.end()),
+                                &labels),
+              succeeded);
+    if (succeeded) {
+      EXPECT_EQ(labels, std::vector<Label>(expected.begin(), expected.end()));
+    }
+    std::string expected_utf8;
+    ASSERT_TRUE(::fst::LabelsToUTF8String(
+        std::vector<Label>(expected.begin(), expected.end()), &expected_utf8));
+    std::string utf8_input;
+    ASSERT_TRUE(::fst::LabelsToUTF8String(
+        std::vector<Label>(input.begin(), input.end()), &utf8_input));
+    std::string utf8_output;
+    EXPECT_EQ(grm.RewriteCodepoints(rule, input, &utf8_output), succeeded);
+    if (succeeded) EXPECT_EQ(utf8_output, expected_utf8);
+    EXPECT_EQ(grm.RewriteString(rule, utf8_input, ::fst::TokenType::UTF8,
+                                &utf8_output),
+              succeeded);
+    if (succeeded) EXPECT_EQ(utf8_output, expected_utf8);
+  }
+  // Invalid UTF-8 input fails, as does output which cannot be encoded.
+  std::string output;
+  EXPECT_FALSE(
+      grm.RewriteString("GREEK", "\xce", ::fst::TokenType::UTF8, &output));
+  std::u32string codepoints;
+  ASSERT_TRUE(grm.RewriteCodepoints("EMOJI", U"a", &codepoints));
+  EXPECT_EQ(codepoints, std::u32string({0xD800}));
+  EXPECT_FALSE(grm.RewriteCodepoints("EMOJI", U"a", &output));
+  EXPECT_TRUE(output.empty());
+}
+
+// Only the labels on successful paths are in the alphabet.
+TEST(InputAlphabetTest, CollectsLabelsOnSuccessfulPaths) {
+  auto fst = MakeLabelRule({{U"ab", U"x"}, {{0x3b1, 0x3b2, 0x3b4}, U"y"}});
+  // A dead end.
+  const auto dead_end = fst->AddState();
+  fst->AddArc(fst->Start(), StdArc('c', 'c', StdArc::Weight::One(), dead_end));
+  const ::fst::InputAlphabet<StdArc> alphabet(*fst);
+  EXPECT_TRUE(alphabet.Contains(0));
+  EXPECT_TRUE(alphabet.Contains('a'));
+  EXPECT_TRUE(alphabet.Contains('b'));
+  EXPECT_FALSE(alphabet.Contains('c'));
+  EXPECT_TRUE(alphabet.Contains(0x3b1));
+  EXPECT_TRUE(alphabet.Contains(0x3b2));
+  EXPECT_FALSE(alphabet.Contains(0x3b3));
+  EXPECT_TRUE(alphabet.Contains(0x3b4));
+  EXPECT_FALSE(alphabet.Contains(0x3b5));
+  EXPECT_TRUE(alphabet.ContainsBytes(std::string_view("ba\0", 3)));
+  EXPECT_FALSE(alphabet.ContainsBytes("abc"));
+  const std::u32string labels = {0x3b4, 'a'};
+  EXPECT_TRUE(alphabet.ContainsAll(labels.begin(), labels.end()));
+}
+
+// Inputs outside a rule's alphabet fail without being composed with it, as
+// they would if composed.
+TEST(GrmManagerTest, AlphabetRejectsAsCompositionWould) {
+  Manager plain;
+  Manager rejecting;
+  auto opts = rejecting.GetOptions();
+  opts.input_alphabets = true;
+  opts.collect_rule_stats = true;
+  rejecting.SetOptions(opts);
+  for (auto* grm : {&plain, &rejecting}) {
+    std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+    auto rule = MakeLabelRule(
+        {{U"a", U"x"}, {U"ab", U"yz"}, {{0x3b1}, U"w"}});
+    const auto dead_end = rule->AddState();
+    rule->AddArc(rule->Start(),
+                 StdArc('c', 'c', StdArc::Weight::One(), dead_end));
+    rules.emplace_back("RULE", std::move(rule));
+    LoadRules(grm, std::move(rules));
+  }
+  for (const std::string input : {"a", "ab", "abc", "c", "d", ""}) {
+    SCOPED_TRACE(input);
+    std::string expected;
+    std::string output;
+    const bool succeeded = plain.RewriteBytes("RULE", input, &expected);
+    EXPECT_EQ(rejecting.RewriteBytes("RULE", input, &output), succeeded);
+    if (succeeded) EXPECT_EQ(output, expected);
+  }
+  for (const auto& input :
+       std::vector<std::u32string>{{0x3b1}, U"b", {0x3b2}}) {
+    std::u32string expected;
+    std::u32string output;
+    const bool succeeded = plain.RewriteCodepoints("RULE", input, &expected);
+    EXPECT_EQ(rejecting.RewriteCodepoints("RULE", input, &output), succeeded);
+    if (succeeded) EXPECT_EQ(output, expected);
+  }
+  // Rejected inputs are never composed with the rule.
+  rejecting.ResetRuleStats();
+  std::string output;
+  EXPECT_FALSE(rejecting.RewriteBytes("RULE", "c", &output));
+  EXPECT_FALSE(rejecting.RewriteBytes("RULE", "d", &output));
+  const auto& stats = rejecting.GetRuleStats().at("RULE");
+  EXPECT_EQ(stats.failures, 2u);
+  EXPECT_EQ(stats.compositions, 0u);
+}
+
+// Accepts() agrees with whether the rule rewrites the input, whether the
+// domain acceptor is built or exceeds the budget.
+TEST(GrmManagerTest, AcceptsAsRewriteSucceeds) {
+  for (const int64_t max_domain_states : {-1, 1}) {
+    SCOPED_TRACE(max_domain_states);
+    Manager grm;
+    auto opts = grm.GetOptions();
+    opts.max_domain_states = max_domain_states;
+    grm.SetOptions(opts);
+    std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+    // Nondeterministic on input, with input epsilons and a loop: "ab*c" or
+    // "a" or "" with an inserted output.
+    auto rule = MakeRule({{"a", "x"}, {"", "e"}});
+    const auto loop = rule->AddState();
+    const auto final_state = rule->AddState();
+    rule->AddArc(rule->Start(), StdArc('a', 'y', StdArc::Weight(1), loop));
+    rule->AddArc(loop, StdArc('b', 0, StdArc::Weight::One(), loop));
+    rule->AddArc(loop, StdArc('c', 'z', StdArc::Weight::One(), final_state));
+    rule->SetFinal(final_state, StdArc::Weight::One());
+    rules.emplace_back("RULE", std::move(rule));
+    LoadRules(&grm, std::move(rules));
+    for (const std::string input :
+         {"", "a", "ac", "abc", "abbbc", "ab", "b", "acc", "ca"}) {
+      SCOPED_TRACE(input);
+      std::string output;
+      EXPECT_EQ(grm.Accepts("RULE", input),
+                grm.RewriteBytes("RULE", input, &output));
+    }
+    EXPECT_FALSE(grm.Accepts("MISSING", "a"));
+  }
+}
+
+// RewriteFirst() uses the first rule, in priority order, which rewrites the
+// input, as trying each in turn would, whether the dispatch acceptor is built
+// or exceeds the budget.
+TEST(GrmManagerTest, RewriteFirstTriesRulesInOrder) {
+  const std::vector<std::string> priority = {"NUMBER", "WORD", "ANY"};
+  for (const int64_t max_domain_states : {-1, 1}) {
+    SCOPED_TRACE(max_domain_states);
+    Manager grm;
+    auto opts = grm.GetOptions();
+    opts.max_domain_states = max_domain_states;
+    grm.SetOptions(opts);
+    std::vector<std::pair<std::string, std::unique_ptr<Transducer>>> rules;
+    // The domains overlap, so that the order decides.
+    rules.emplace_back("NUMBER", MakeRule({{"1", "one"}, {"12", "twelve"}}));
+    rules.emplace_back("WORD", MakeRule({{"ab", "AB"}, {"1", "word"}}));
+    rules.emplace_back("ANY", MakeRule({{"ab", "any"}, {"c", "C"}, {"", ""}}));
+    LoadRules(&grm, std::move(rules));
+    for (const std::string input : {"1", "12", "ab", "c", "", "d", "123"}) {
+      SCOPED_TRACE(input);
+      std::string expected;
+      size_t expected_index = priority.size();
+      for (size_t i = 0; i < priority.size(); ++i) {
+        if (grm.RewriteBytes(priority[i], input, &expected)) {
+          expected_index = i;
+          break;
+        }
+      }
+      std::string output;
+      size_t index = priority.size();
+      EXPECT_EQ(grm.RewriteFirst(priority, input, &output, &index),
+                expected_index < priority.size());
+      EXPECT_EQ(index, expected_index);
+      if (expected_index < priority.size()) EXPECT_EQ(output, expected);
+    }
+    std::string output;
+    size_t index = 0;
+    ASSERT_TRUE(grm.RewriteFirst(priority, "1", &output, &index));
+    EXPECT_EQ(output, "one");
+    EXPECT_EQ(index, 0u);
+    // Reordering the rules changes the choice.
+    ASSERT_TRUE(grm.RewriteFirst({"WORD", "NUMBER"}, "1", &output, &index));
+    EXPECT_EQ(output, "word");
+    EXPECT_EQ(index, 0u);
+    ASSERT_TRUE(grm.RewriteFirst(priority, "ab", &output, &index));
+    EXPECT_EQ(output, "AB");
+    EXPECT_EQ(index, 1u);
+    // A missing rule is skipped, as are rules which do not rewrite the input.
+    ASSERT_TRUE(grm.RewriteFirst({"MISSING", "ANY"}, "c", &output, &index));
+    EXPECT_EQ(output, "C");
+    EXPECT_EQ(index, 1u);
+    EXPECT_FALSE(grm.RewriteFirst(priority, "d", &output, &index));
+  }
+}
+
+}  // namespace
+}  // namespace thrax
@@ -29,6 +29,7 @@
 #include <fst/string.h>
 #include <fst/symbol-table.h>
 #include <fst/vector-fst.h>
+#include <thrax/algo/nbest.h>
 #include <thrax/algo/paths.h>
 #include <thrax/grm-manager.h>
 
@@ -40,15 +41,14 @@ namespace {
 
 using ::fst::kNoStateId;
 using ::fst::LabelsToUTF8String;
+using ::fst::NBestStrings;
 using ::fst::PathIterator;
-using ::fst::Project;
-using ::fst::ProjectType;
-using ::fst::RmEpsilon;
 using ::fst::ShortestPath;
 using ::fst::StdArc;
 using ::fst::StdVectorFst;
 using ::fst::SymbolTable;
 using ::fst::TokenType;
+using ::fst::TropicalWeight;
 
 using Label = StdArc::Label;
 
@@ -95,17 +95,25 @@ bool FstToStrings(const StdVectorFst &fst,
                   std::vector<std::pair<std::string, float>> *strings,
                   const SymbolTable *generated_symtab, TokenType type,
                   SymbolTable *symtab, size_t n) {
-  StdVectorFst shortest_path;
-  if (n == 1) {
-    ShortestPath(fst, &shortest_path, n);
-  } else {
-    // The uniqueness feature of ShortestPath requires us to have an acceptor,
-    // so we project and remove epsilon arcs.
-    StdVectorFst temp(fst);
-    Project(&temp, ProjectType::OUTPUT);
-    RmEpsilon(&temp);
-    ShortestPath(temp, &shortest_path, n, /*unique=*/true);
+  if (n > 1) {
+    // Enumerates the distinct outputs lazily rather than determinizing the
+    // whole lattice as ShortestPath() with unique = true would.
+    std::vector<std::vector<Label>> label_strings;
+    std::vector<TropicalWeight> weights;
+    if (!NBestStrings(fst, n, &label_strings, &weights)) return false;
+    for (size_t i = 0; i < label_strings.size(); ++i) {
+      std::string path;
+      for (const auto label : label_strings[i]) {
+        if (!AppendLabel(label, type, generated_symtab, symtab, &path)) {
+          return false;
+        }
+      }
+      strings->emplace_back(std::move(path), weights[i].Value());
+    }
+    return true;
   }
+  StdVectorFst shortest_path;
+  ShortestPath(fst, &shortest_path, n);
   if (shortest_path.Start() == kNoStateId) return false;
   for (PathIterator<StdArc> iter(shortest_path, /*check_acyclic=*/false);
        !iter.Done(); iter.Next()) {
@@ -14,14 +14,26 @@
 //
 // The AbstractGrmManager holds a set of FSTs in memory and performs rewrites
 // via composition. The class is parametrized by the FST arc type.
-// AbstractGrmManager is thread-compatible.
+// AbstractGrmManager is thread-compatible; in addition, rewrites may run
+// concurrently with loading or replacing rules, which publish an immutable new
+// generation of rules rather than modifying the one in use.
 
 #ifndef NLP_GRM_LANGUAGE_ABSTRACT_GRM_MANAGER_H_
 #define NLP_GRM_LANGUAGE_ABSTRACT_GRM_MANAGER_H_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <istream>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <fst/compat.h>
@@ -35,14 +47,115 @@
 #include <fst/arc.h>
 #include <fst/fst.h>
 #include <fst/fstlib.h>
+#include <fst/memory.h>
 #include <fst/string.h>
 #include <fst/vector-fst.h>
+#include <thrax/algo/alphabet.h>
+#include <thrax/algo/bestpath.h>
+#include <thrax/algo/boundedexpand.h>
+#include <thrax/algo/bytetable.h>
+#include <thrax/algo/compact.h>
+#include <thrax/algo/domain.h>
+#include <thrax/algo/nbest.h>
+#include <thrax/algo/optimize.h>
+#include <thrax/algo/sequential.h>
+#include <thrax/compat/thread-pool.h>
+#include <thrax/indexed-far.h>
 #include <thrax/make-parens-pair-vector.h>
+#include <thrax/prepared-far.h>
+#include <thrax/rewrite-cache.h>
+#include <thrax/rule-stats.h>
+#include <thrax/symbol-table-pool.h>
 #include <unordered_map>
 #include <string_view>
 
 namespace thrax {
 
+// Options controlling how the manager loads and stores its rules.
+struct GrmManagerOptions {
+  // Memory-maps rules, rather than reading them into the heap, when loading
+  // archives whose rules are stored as aligned ConstFsts (as written by
+  // ExportFar() when --mappable_far is set). Rules stored in other forms are
+  // read as usual.
+  bool map_archive = false;
+  // If positive, RewriteBytes() results for byte string inputs, including
+  // failures, are cached using at most about this many bytes. The cache is
+  // cleared whenever a new generation of rules is published.
+  size_t rewrite_cache_bytes = 0;
+  // Prepares the rules with input epsilons (such as those compiled from
+  // context-dependent rewrites) for label-lookahead composition when loading
+  // them, so that composition does not build states from which the rule's
+  // next input label cannot be matched. Each such rule is kept in both forms.
+  bool label_lookahead = false;
+  // If positive, builds direct-indexed byte transition tables, used during
+  // composition in place of binary search, for the states of each rule with
+  // at least this many arcs. Each table takes about 1 KB.
+  size_t byte_table_min_arcs = 0;
+  // Collects the input alphabet of each rule (the input labels on its
+  // successful paths) when loading it, so that string inputs with labels
+  // outside it are rejected without composing them with the rule.
+  bool input_alphabets = false;
+  // The most states of the deterministic acceptor of a rule's input side
+  // built on its first Accepts() call; rules whose acceptors would be larger
+  // are checked by rewriting instead. A negative limit means no limit.
+  int64_t max_domain_states = 1 << 20;
+  // Stores each rule read into the heap in the smallest representation able
+  // to hold it: a CompactFst for strings, unweighted rules, and weighted
+  // acceptors, and a ConstFst for weighted transducers. Compact rules are
+  // expanded state by state into a cache private to each thread as they are
+  // read, so this trades some speed for memory.
+  bool compact_rules = false;
+  // Reads only the index of an archive when loading it, and each rule (which
+  // is then prepared as the options above say) the first time it is looked
+  // up. Requires an STTable archive.
+  bool lazy_load = false;
+  // Rules read when an archive is loaded lazily, rather than on first use.
+  std::vector<std::string> preload_rules;
+  // The number of threads used to read, sort and compact the rules of an
+  // archive when loading it (or after compiling it); zero means one per
+  // hardware thread. The resulting rules do not depend on the number.
+  int load_threads = 0;
+  // Checks the fingerprint of each rule read from a prepared archive (see
+  // thrax/prepared-far.h) against the archive's manifest, failing the load on
+  // a mismatch. This reads every rule in full.
+  bool verify_prepared_far = false;
+  // Shares the symbol tables of the rules read into the heap among all rules
+  // with equal tables. Rules mapped from an archive keep their own.
+  bool intern_symbols = false;
+  // Records, for each rule and cascade, the number of rewrites and failures, a
+  // latency histogram, and the sizes of the composed lattices and outputs;
+  // see AbstractGrmManager::GetRuleStats(). This costs two clock reads and
+  // an uncontended lock for each rewrite.
+  bool collect_rule_stats = false;
+};
+
+// The effect of GrmManagerOptions::compact_rules on a generation of rules.
+struct CompactionStats {
+  size_t num_rules = 0;
+  size_t num_compacted = 0;
+  // Approximate memory used by the rules considered, before and after.
+  size_t bytes_before = 0;
+  size_t bytes_after = 0;
+};
+
+// Options controlling how streaming rewrites split their input.
+struct StreamRewriteOptions {
+  // The acceptor matching the boundaries at which the input may safely be
+  // split, such as runs of whitespace or sentence-final punctuation. Segments
+  // end after the longest match starting at each position.
+  std::string boundary_rule;
+  // Consecutive segments are rewritten together as long as they fit in this
+  // many bytes; zero rewrites each segment separately. Input running this far
+  // past the last boundary is cut regardless, even if that is not safe.
+  size_t max_segment_bytes = 4096;
+  // Passes segments which fail to rewrite through unchanged, rather than
+  // failing the whole stream.
+  bool copy_failed_segments = false;
+};
+
+template <typename Arc>
+class RuleCascade;
+
 template <typename Arc>
 class AbstractGrmManager {
  public:
@@ -52,13 +165,186 @@ class AbstractGrmManager {
       std::map<std::string, std::unique_ptr<const Transducer>, std::less<>>;
   using Label = typename Arc::Label;
 
+  // An immutable snapshot of the rules held by the manager. Each rewrite pins
+  // the current generation for its duration, so that a new generation may be
+  // published (by loading an archive or replacing a rule) while rewrites are
+  // in flight; a retired generation is freed once no reader holds it.
+  class Generation {
+   public:
+    Generation() {
+      static std::atomic<uint64_t> next_id(0);
+      id_ = next_id.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Identifies the generation uniquely within the process.
+    uint64_t Id() const { return id_; }
+
+    // If the generation was loaded lazily, this reads all remaining rules.
+    const FstMap& GetFstMap() const;
+
+    // How the rules were compacted when loaded, if they were.
+    CompactionStats GetCompactionStats() const {
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      return compaction_stats_;
+    }
+
+    // Returns the named FST, or nullptr if there is none. The pointer remains
+    // valid for the lifetime of the generation. If the generation was loaded
+    // lazily, the rule is read and prepared on first use; concurrent callers
+    // wait for that to finish.
+    const Transducer* GetFst(std::string_view name) const {
+      if (lazy_) return GetLazyFst(name);
+      const auto it = fsts_.find(name);
+      return it == fsts_.end() ? nullptr : it->second.get();
+    }
+
+    // Returns a thread-safe copy of the named FST, or nullptr if there is none.
+    std::unique_ptr<Transducer> GetFstSafe(std::string_view name) const {
+      const auto* fst = GetFst(name);
+      return fst::WrapUnique(fst ? fst->Copy(true) : nullptr);
+    }
+
+    // Returns the object derived from the generation's rules under the given
+    // key, calling make() to build it on first use. make() returns a
+    // std::unique_ptr<T>, which is null if the object cannot be built; either
+    // way, the result is kept for the lifetime of the generation. make() runs
+    // outside the generation's lock, so that objects under different keys are
+    // built concurrently; concurrent callers asking for the same key wait for
+    // its build. make() may itself call GetDerived() for other keys.
+    template <typename T, typename Make>
+    const T* GetDerived(std::string_view key, Make make) const {
+      const auto derived = FindOrAddDerived(key);
+      std::call_once(derived->once, [&] {
+        derived->value = std::shared_ptr<const T>(make());
+        derived->ready.store(true, std::memory_order_release);
+      });
+      return static_cast<const T*>(derived->value.get());
+    }
+
+    // Returns the object derived under the given key, or nullptr if there is
+    // none (or it could not be built, or is still being built).
+    template <typename T>
+    const T* FindDerived(std::string_view key) const {
+      std::lock_guard<std::mutex> lock(derived_mutex_);
+      const auto it = derived_.find(key);
+      if (it == derived_.end() ||
+          !it->second->ready.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      return static_cast<const T*>(it->second->value.get());
+    }
+
+   private:
+    friend class AbstractGrmManager;
+
+    struct LazyRule {
+      std::once_flag once;
+      std::unique_ptr<const Transducer> fst;
+    };
+
+    // The rules of a lazily loaded archive, indexed as in the reader.
+    struct LazyArchive {
+      std::unique_ptr<IndexedFarReader<Arc>> reader;
+      std::string filename;
+      GrmManagerOptions opts;
+      std::shared_ptr<SymbolTablePool> symbol_pool;
+      std::unique_ptr<LazyRule[]> rules;
+      std::once_flag all_once;
+      FstMap all;
+    };
+
+    // An object derived from the rules, built once.
+    struct Derived {
+      std::once_flag once;
+      // Set once the value has been built.
+      std::atomic<bool> ready{false};
+      std::shared_ptr<const void> value;
+    };
+
+    const Transducer* GetLazyFst(std::string_view name) const;
+
+    std::shared_ptr<Derived> FindOrAddDerived(std::string_view key) const {
+      std::lock_guard<std::mutex> lock(derived_mutex_);
+      auto it = derived_.find(key);
+      if (it == derived_.end()) {
+        it = derived_.emplace(std::string(key), std::make_shared<Derived>())
+                 .first;
+      }
+      return it->second;
+    }
+
+    uint64_t id_;
+    // Empty if the generation was loaded lazily.
+    FstMap fsts_;
+    std::unique_ptr<LazyArchive> lazy_;
+    mutable std::mutex stats_mutex_;
+    CompactionStats compaction_stats_;
+    // The pooled symbol tables used by the rules, interned when the generation
+    // is prepared or, if it was loaded lazily, as its rules are read.
+    mutable SymbolTableRefs symbol_tables_;
+    // Only guards the map; the objects are built outside it. Entries may be
+    // shared with later generations, and are never removed.
+    mutable std::mutex derived_mutex_;
+    mutable std::map<std::string, std::shared_ptr<Derived>, std::less<>>
+        derived_;
+  };
+
+  // Per-thread state reused across rewrites: the rules bound in the generation
+  // last used, and pooled scratch FSTs. A context may be used with any number
+  // of managers, but only by one thread at a time; each thread keeps one for
+  // each of the managers it used last. A context only pins a generation for
+  // the duration of a rewrite. The rules bound in it are kept, and reused by
+  // the next rewrite if that generation is still current, but do not keep it
+  // alive.
+  class RewriteContext;
+
+  // A rule, with its PDT parentheses and MPDT assignments rules if any,
+  // resolved once in the generation current when the handle was made.
+  // Rewriting through a handle involves no lookups by name and, for rules
+  // which may be read concurrently (as are all rules loaded from archives), no
+  // copies and no writes to state shared with other threads. The handle keeps
+  // its generation alive and goes on using it after newer ones are published.
+  // Handles are immutable and may be used by any number of threads at once.
+  class RuleHandle;
+
+  // Rewrites a stream of bytes segment by segment; see MakeStreamRewriter().
+  class StreamRewriter;
+
   virtual ~AbstractGrmManager();
 
-  // Read-only access to the underlying FST map.
-  const FstMap& GetFstMap() const { return fsts_; }
+  const GrmManagerOptions& GetOptions() const { return opts_; }
+
+  // Loading options only take effect for rules loaded after they are set.
+  // Statistics collected so far are kept unless collection is turned off.
+  // This must not be called while other threads are rewriting.
+  void SetOptions(const GrmManagerOptions& opts) {
+    opts_ = opts;
+    cache_ = MakeCache(opts_);
+    if (!opts_.collect_rule_stats) {
+      rule_stats_.reset();
+    } else if (!rule_stats_) {
+      rule_stats_ = std::make_unique<RuleStatsCollector>();
+    }
+  }
+
+  // Returns the rewrite result cache, or nullptr if caching is disabled.
+  const RewriteCache* GetRewriteCache() const { return cache_.get(); }
+
+  // Returns the current generation of rules. Holding the returned pointer keeps
+  // the generation, and thus its FSTs, alive after newer ones are published.
+  std::shared_ptr<const Generation> GetGeneration() const {
+    return std::atomic_load(&generation_);
+  }
+
+  // Read-only access to the underlying FST map. The reference is invalidated
+  // when a new generation is published; readers which may race with writers
+  // should pin a generation with GetGeneration() instead.
+  const FstMap& GetFstMap() const { return GetGeneration()->GetFstMap(); }
 
-  // Compile-time access to the FST table.
-  FstMap* GetFstMap() { return &fsts_; }
+  // Compile-time access to the FST table. This modifies the current generation
+  // in place, so it must not be used while other threads are rewriting, nor
+  // on a lazily loaded generation.
+  FstMap* GetFstMap() { return &generation_->fsts_; }
 
   // ***************************************************************************
   // REWRITE: These functions perform the actual rewriting of inputs using the
@@ -72,6 +358,10 @@ class AbstractGrmManager {
   // is assumed to be a pushdown automaton, and that associated with
   // pdt_parens_rule is assumed to specify the parentheses. If
   // pdt_assignments_rule is not empty, then this is assumed to be an MPDT.
+  //
+  // If the rule is sequential (i.e., input-deterministic and free of input
+  // epsilons) and is not a PDT, the byte string input is rewritten by walking
+  // the rule directly rather than by composition.
 
   bool RewriteBytes(std::string_view rule, std::string_view input,
                     std::string* output, std::string_view pdt_parens_rule = "",
@@ -81,6 +371,55 @@ class AbstractGrmManager {
                     std::string* output, std::string_view pdt_parens_rule = "",
                     std::string_view mpdt_assignments_rule = "") const;
 
+  // As above, but using the caller's context. The overloads without a context
+  // use one private to the calling thread.
+  bool RewriteBytes(RewriteContext* context, std::string_view rule,
+                    std::string_view input, std::string* output,
+                    std::string_view pdt_parens_rule = "",
+                    std::string_view mpdt_assignments_rule = "") const;
+
+  // As above, but using a handle made by GetRuleHandle(). If the context is
+  // null, one private to the calling thread is used.
+  bool RewriteBytes(const RuleHandle& handle, std::string_view input,
+                    std::string* output,
+                    RewriteContext* context = nullptr) const;
+
+  bool RewriteBytes(const RuleHandle& handle, const Transducer& input,
+                    std::string* output,
+                    RewriteContext* context = nullptr) const;
+
+  // Rewrites a string of labels, such as Unicode codepoints or symbol IDs, as
+  // RewriteBytes() does byte strings, storing the output labels. Sequential
+  // rules are walked along the input; otherwise the input is laid out in the
+  // calling thread's scratch FST, reusing its storage, rather than compiled
+  // into a new FST.
+  bool RewriteLabels(std::string_view rule, const std::vector<Label>& input,
+                     std::vector<Label>* output,
+                     std::string_view pdt_parens_rule = "",
+                     std::string_view mpdt_assignments_rule = "") const;
+
+  // As above, for a string of Unicode codepoints, storing the output as
+  // codepoints or encoded as UTF-8. In the latter case, an output label which
+  // is not a codepoint fails the rewrite.
+  bool RewriteCodepoints(std::string_view rule, std::u32string_view input,
+                         std::u32string* output,
+                         std::string_view pdt_parens_rule = "",
+                         std::string_view mpdt_assignments_rule = "") const;
+
+  bool RewriteCodepoints(std::string_view rule, std::u32string_view input,
+                         std::string* output,
+                         std::string_view pdt_parens_rule = "",
+                         std::string_view mpdt_assignments_rule = "") const;
+
+  // Rewrites a string tokenized as the token type says, storing the output
+  // tokenized the same way: BYTE is as RewriteBytes(), and UTF8 as
+  // RewriteCodepoints() on the decoded input. SYMBOL is not supported, as
+  // there is no symbol table to consult; use RewriteLabels() instead.
+  bool RewriteString(std::string_view rule, std::string_view input,
+                     ::fst::TokenType token_type, std::string* output,
+                     std::string_view pdt_parens_rule = "",
+                     std::string_view mpdt_assignments_rule = "") const;
+
   // Unlike RewriteBytes(), The MutableTransducer output of Rewrite() contains
   // all the possible output paths. A Rewrite() call only returns false if the
   // specified rule(s) cannot be found. Notably, the call returns true even if
@@ -96,6 +435,106 @@ class AbstractGrmManager {
                std::string_view pdt_parens_rule = "",
                std::string_view mpdt_assignments_rule = "") const;
 
+  bool Rewrite(const RuleHandle& handle, const Transducer& input,
+               MutableTransducer* output) const;
+
+  // Rewrites the input to its n best distinct outputs, stored in order of
+  // increasing weight, with their weights if weights is non-null. Fewer than n
+  // outputs are returned if there are fewer. Returns false on a failed
+  // rewrite. Unlike taking the n shortest unique paths, which determinizes the
+  // whole output lattice, this determinizes the lattice lazily and stops once
+  // the n best outputs are found. The weight must have the path property.
+  bool RewriteNBest(std::string_view rule, std::string_view input, size_t n,
+                    std::vector<std::string>* outputs,
+                    std::vector<typename Arc::Weight>* weights = nullptr,
+                    std::string_view pdt_parens_rule = "",
+                    std::string_view mpdt_assignments_rule = "") const;
+
+  // Returns true if the rule accepts the byte string as input, without
+  // building any output. The first call for a rule builds the minimal
+  // deterministic acceptor of its input side, which is kept with the current
+  // generation of rules, and each call then walks it over the input. The
+  // acceptor is built without holding the generation's lock, so rewrites
+  // with other rules proceed meanwhile; concurrent calls for the same rule
+  // wait for it. PDT rules, and rules whose acceptors would exceed
+  // GrmManagerOptions::max_domain_states, are instead checked by rewriting
+  // the input.
+  bool Accepts(std::string_view rule, std::string_view input,
+               std::string_view pdt_parens_rule = "",
+               std::string_view mpdt_assignments_rule = "") const;
+
+  // Rewrites the input with the first of the rules, in order of priority,
+  // which can rewrite it, as calling RewriteBytes() with each in turn would,
+  // storing that rule's index if index is non-null. Returns false if none
+  // can. The first call for a list of rules builds a deterministic acceptor of
+  // the union of their input sides, each followed by a marker naming its rule,
+  // which is kept with the current generation of rules. A single walk over
+  // the input then finds the rules which accept it, and only those are
+  // composed with it. If the acceptor would exceed
+  // GrmManagerOptions::max_domain_states, each rule is tried in turn.
+  bool RewriteFirst(const std::vector<std::string>& rules,
+                    std::string_view input, std::string* output,
+                    size_t* index = nullptr) const;
+
+  // Returns a rewriter for a byte stream, or nullptr, logging the missing rule,
+  // if one of the rules cannot be found. The stream is split at the boundaries
+  // matched by the options' boundary rule and each segment is rewritten on its
+  // own, as RewriteBytes() does, so memory use is bounded by the size of a
+  // segment rather than that of the stream. The outputs are passed to emit()
+  // in order; if it returns false, the stream is abandoned. All segments use
+  // the generation of rules current when the rewriter is made.
+  std::unique_ptr<StreamRewriter> MakeStreamRewriter(
+      std::string_view rule, const StreamRewriteOptions& opts,
+      std::function<bool(std::string_view)> emit,
+      std::string_view pdt_parens_rule = "",
+      std::string_view mpdt_assignments_rule = "") const;
+
+  // Rewrites the whole stream through a stream rewriter. Returns false if a
+  // rule cannot be found, reading fails, a segment cannot be rewritten (unless
+  // the options say to copy it), or emit() returns false.
+  bool RewriteStream(std::string_view rule, std::istream* input,
+                     const StreamRewriteOptions& opts,
+                     std::function<bool(std::string_view)> emit,
+                     std::string_view pdt_parens_rule = "",
+                     std::string_view mpdt_assignments_rule = "") const;
+
+  // Rewrites each of the inputs as RewriteBytes() does, storing the output for
+  // inputs[i] in (*outputs)[i], which is left empty if the rewrite fails. If
+  // succeeded is non-null, (*succeeded)[i] records whether inputs[i] was
+  // rewritten. The inputs are distributed over the threads of the pool, or
+  // rewritten on the calling thread if the pool is null; either way, the whole
+  // batch uses the same generation of rules. Returns the number of successful
+  // rewrites.
+  size_t RewriteBatch(std::string_view rule,
+                      const std::vector<std::string_view>& inputs,
+                      std::vector<std::string>* outputs,
+                      std::vector<bool>* succeeded = nullptr,
+                      ThreadPool* pool = nullptr,
+                      std::string_view pdt_parens_rule = "",
+                      std::string_view mpdt_assignments_rule = "") const;
+
+  // Returns a handle to the named rules in the current generation, or nullptr,
+  // logging the missing rule, if one of them cannot be found.
+  std::unique_ptr<const RuleHandle> GetRuleHandle(
+      std::string_view rule, std::string_view pdt_parens_rule = "",
+      std::string_view mpdt_assignments_rule = "") const;
+
+  // Returns the statistics recorded so far for each rule and cascade (the
+  // latter named "cascade:" followed by their rules), merged from all
+  // threads, if GrmManagerOptions::collect_rule_stats is set.
+  RuleStatsMap GetRuleStats() const {
+    return rule_stats_ ? rule_stats_->Get() : RuleStatsMap();
+  }
+
+  // As above, in the Prometheus text exposition format.
+  std::string GetRuleStatsText() const {
+    return RuleStatsToPrometheus(GetRuleStats());
+  }
+
+  void ResetRuleStats() {
+    if (rule_stats_) rule_stats_->Reset();
+  }
+
   // This helper function (when given a potential string fst) takes the shortest
   // path, projects the output, and then removes epsilon arcs.
   static void StringifyFst(MutableTransducer* output);
@@ -105,7 +544,8 @@ class AbstractGrmManager {
 
   // Returns the FST associated with the particular name. This class returns
   // the actual pointer to the FST (or nullptr if it is not found), so the
-  // caller should not free the pointer.
+  // caller should not free the pointer. The pointer is only valid until a new
+  // generation is published.
   const Transducer* GetFst(std::string_view name) const;
 
   // Gets the named FST, just like GetFst(), but this function doesn't lock
@@ -114,209 +554,2239 @@ class AbstractGrmManager {
   std::unique_ptr<Transducer> GetFstSafe(std::string_view name) const;
 
   // Modify the transducer under the given name. If no such rule name exists,
-  // returns false, otherwise returns true. Note: For thread-safety, it is
-  // assumed this function will not be used in a multi-threaded context.
+  // returns false, otherwise returns true. The replacement is published as a
+  // new generation, so this may be called while other threads are rewriting.
   bool SetFst(std::string_view name, const Transducer& input);
 
   // This function will write the created FSTs into an FST archive with the
   // provided filename.
   virtual void ExportFar(const std::string& filename) const = 0;
 
-  // Sorts input labels of all FSTs in the archive.
+  // Sorts input labels of all FSTs in the archive, and computes the properties
+  // used to select the sequential rewrite path, spreading the rules over
+  // GrmManagerOptions::load_threads threads. This modifies the current
+  // generation in place, so it must not be used while other threads are
+  // rewriting.
   void SortRuleInputLabels();
 
   // Alternative to LoadArchive, allowing you to provide the FSTs and keys
-  // directly.
+  // directly. The FSTs are published as a new generation.
   void LoadFstMap(FstMap named_fsts);
 
  protected:
   AbstractGrmManager();
 
-  // Loads up the FSTs given the supplied reader. Returns true on success and
-  // false otherwise.
+  explicit AbstractGrmManager(const GrmManagerOptions& opts);
+
+  // Loads up the FSTs given the supplied reader and publishes them as a new
+  // generation. Returns true on success and false otherwise, in which case the
+  // current generation is kept.
   template <typename FarReader>
   bool LoadArchive(FarReader* reader, std::string_view filename = "");
 
-  // The list of FSTs held by this manager.
-  FstMap fsts_;
+  // As LoadArchive(), but reading the rules concurrently, as many at a time as
+  // GrmManagerOptions::load_threads allows. Prepared archives are recognized
+  // by their manifest, and their rules and artifacts used as stored.
+  bool LoadArchive(const IndexedFarReader<Arc>& reader,
+                   std::string_view filename = "");
+
+  // As LoadArchive(), but reading only the archive's index and the preloaded
+  // rules up front; see GrmManagerOptions::lazy_load.
+  bool LoadArchiveLazily(std::unique_ptr<IndexedFarReader<Arc>> reader,
+                         std::string_view filename = "");
+
+  // Returns true if the FST is fully expanded in memory (i.e., it is a
+  // VectorFst or a ConstFst), so that it may be shared without deep-copying it.
+  static bool IsExpanded(const Transducer& fst);
+
+  // The form in which rules are prepared for label-lookahead composition, and
+  // stored in prepared archives.
+  using LookAheadTransducer = ::fst::MatcherFst<
+      ::fst::ConstFst<Arc>,
+      ::fst::LabelLookAheadMatcher<::fst::SortedMatcher<::fst::ConstFst<Arc>>,
+                                   ::fst::ilabel_lookahead_flags,
+                                   ::fst::FastLogAccumulator<Arc>>,
+      ::fst::ilabel_lookahead_fst_type, ::fst::LabelLookAheadRelabeler<Arc>>;
+
+  // Whether a rule is prepared for label-lookahead composition when the
+  // label_lookahead option is set.
+  static bool UsesLookAhead(const Transducer& fst) {
+    return fst.Properties(::fst::kIEpsilons, true) == ::fst::kIEpsilons;
+  }
+
+  GrmManagerOptions opts_;
+
+ private:
+  friend class RuleCascade<Arc>;
+
+  // Sorts and computes the properties of a single rule, replacing it by a
+  // sorted copy if necessary.
+  static void PrepareRule(std::unique_ptr<const Transducer>* fst);
+
+  // As PrepareRule(), for each rule, spreading the rules over the pool if it
+  // is non-null.
+  static void PrepareRules(FstMap* fsts, ThreadPool* pool = nullptr);
+
+  // Replaces the symbol tables of a rule held as a VectorFst by pooled ones.
+  static void InternSymbols(SymbolTablePool* symbol_pool,
+                            std::unique_ptr<const Transducer>* fst,
+                            SymbolTableRefs* refs);
+
+  // Returns a pool for preparing the given number of rules, or nullptr if
+  // they should be prepared on the calling thread.
+  std::unique_ptr<ThreadPool> MakeLoadPool(size_t num_rules) const;
+
+  // Sorts (unless the rules are known to be prepared already), compacts and
+  // prepares matchers for the rules of a new generation.
+  void PrepareGeneration(Generation* generation, ThreadPool* pool,
+                         bool prepared = false) const;
+
+  // Atomically replaces the current generation.
+  void Publish(std::shared_ptr<Generation> generation);
+
+  // The parentheses and assignments of a PDT or MPDT, as needed by their
+  // composition algorithms.
+  struct PdtMetadata {
+    std::vector<std::pair<Label, Label>> parens;
+    std::vector<Label> assignments;
+  };
+
+  // A rule prepared for label-lookahead composition. Its input labels are
+  // relabeled so that the labels reachable from each state form intervals, so
+  // the output labels of anything composed with it must be relabeled to match.
+  struct LookAheadRule {
+    std::unique_ptr<const Transducer> fst;
+    // The new labels of bytes, and of any other labels.
+    std::vector<Label> byte_labels;
+    std::unordered_map<Label, Label> other_labels;
+    // Stands for all labels the rule does not accept.
+    Label unknown_label;
+
+    Label Relabel(Label label) const {
+      if (label >= 0 && label < static_cast<Label>(byte_labels.size())) {
+        return byte_labels[label];
+      }
+      const auto it = other_labels.find(label);
+      return it == other_labels.end() ? unknown_label : it->second;
+    }
+  };
+
+  // Replaces the generation's VectorFst rules by compact copies, if the
+  // options say to, recording the memory saved.
+  void CompactRules(Generation* generation, ThreadPool* pool = nullptr) const;
+
+  // Replaces a VectorFst rule by a compact copy if that is smaller, adding to
+  // the statistics.
+  static void CompactRule(std::string_view name,
+                          std::unique_ptr<const Transducer>* fst,
+                          CompactionStats* stats);
+
+  // Prepares the generation's rules for lookahead composition and builds
+  // their byte tables and input alphabets, as the options say, skipping those
+  // already prepared.
+  void PrepareMatchers(const Generation& generation) const;
+
+  static void PrepareMatchers(const GrmManagerOptions& opts,
+                              const Generation& generation,
+                              std::string_view name, const Transducer& fst);
+
+  static std::unique_ptr<LookAheadRule> MakeLookAheadRule(
+      const Transducer& fst);
+
+  static std::unique_ptr<LookAheadRule> MakeLookAheadRule(
+      std::unique_ptr<const LookAheadTransducer> lookahead_fst);
+
+  // Reads the manifest of a prepared archive. Returns false if there is none,
+  // or if it cannot be used, in which case the archive is to be loaded as an
+  // ordinary one.
+  static bool ReadManifest(const IndexedFarReader<Arc>& reader,
+                           std::string_view filename,
+                           PreparedFarManifest* manifest);
+
+  // Identifies the rule's lookahead form among the generation's derived
+  // objects.
+  static std::string LookAheadKey(std::string_view rule) {
+    return "lookahead:" + std::string(rule);
+  }
+
+  using ByteTables = ::fst::ByteTables<Arc>;
+
+  static std::string ByteTablesKey(std::string_view rule) {
+    return "bytetables:" + std::string(rule);
+  }
+
+  using InputAlphabet = ::fst::InputAlphabet<Arc>;
+
+  static std::string InputAlphabetKey(std::string_view rule) {
+    return "alphabet:" + std::string(rule);
+  }
+
+  using DomainAcceptor = ::fst::DomainAcceptor<Arc>;
+
+  static std::string DomainKey(std::string_view rule) {
+    return "domain:" + std::string(rule);
+  }
+
+  // The deterministic acceptor of the input sides of a list of rules, each
+  // followed by its marker, used by RewriteFirst().
+  struct RuleDispatch {
+    std::unique_ptr<const DomainAcceptor> acceptor;
+    // The marker of rule i is first_marker + i; markers follow all input
+    // labels of the rules.
+    Label first_marker = 0;
+
+    // Whether rule i accepts the input which led to the state.
+    bool Accepts(typename Arc::StateId state, size_t i) const {
+      const auto next =
+          acceptor->Next(state, first_marker + static_cast<Label>(i));
+      return next != ::fst::kNoStateId && acceptor->Final(next);
+    }
+  };
+
+  // Returns nullptr if a rule is missing or the acceptor would have more than
+  // max_states states.
+  static std::unique_ptr<RuleDispatch> MakeRuleDispatch(
+      const Generation& generation, const std::vector<std::string>& rules,
+      int64_t max_states);
+
+  // A rule and its PDT parentheses and MPDT assignments rules, looked up in a
+  // pinned generation. Rules which may be read concurrently are used in place;
+  // others are copied for use by a single thread.
+  struct BoundRule {
+    const Transducer* fst = nullptr;
+    // Owns the FST if it was copied, or built for the binding.
+    std::unique_ptr<const Transducer> owned_fst;
+    // Whether the FST may be read by several threads at once.
+    bool thread_safe = false;
+    // Computed once per generation and owned by it; null unless a PDT.
+    const PdtMetadata* pdt_metadata = nullptr;
+    bool mpdt = false;
+    // Owned by the generation; null unless prepared for lookahead.
+    const LookAheadRule* lookahead = nullptr;
+    // Null unless built for the rule; owned by the generation unless built
+    // for the binding.
+    const ByteTables* byte_tables = nullptr;
+    std::unique_ptr<const ByteTables> owned_byte_tables;
+    // Likewise for the rule's input alphabet. A string with a label outside
+    // it cannot be rewritten.
+    const InputAlphabet* alphabet = nullptr;
+    std::unique_ptr<const InputAlphabet> owned_alphabet;
+    // Whether byte strings may be rewritten by walking the rule directly.
+    bool sequential = false;
+    // The name of the rule, under which its statistics are recorded.
+    std::string name;
+    // Identifies the rules and their generation in the result cache.
+    std::string cache_key;
+  };
+
+  // Runs the rewrite, recording it, along with the size of its output (a
+  // string, or an FST) if it succeeds, under the name if statistics are being
+  // collected.
+  template <typename Output, typename Rewriter>
+  bool Record(std::string_view name, RewriteContext* context,
+              const Output* output, Rewriter rewrite) const;
+
+  // Looks up the named rules. Returns false, logging the missing rule, if one
+  // cannot be found.
+  static bool Bind(const Generation& generation, std::string_view rule,
+                   std::string_view pdt_parens_rule,
+                   std::string_view mpdt_assignments_rule, BoundRule* bound);
+
+  // Returns the context used by the calling thread with this manager when
+  // none is supplied.
+  RewriteContext* ThreadLocalContext() const;
+
+  // Pins the manager's current generation in the context for the lifetime of
+  // the guard, or of the outermost guard if they are nested.
+  class ContextPin {
+   public:
+    ContextPin(const AbstractGrmManager& grm, RewriteContext* context);
+
+    // Pins the given generation of the manager's rules instead.
+    ContextPin(const AbstractGrmManager& grm,
+               std::shared_ptr<const Generation> generation,
+               RewriteContext* context);
+
+    ~ContextPin();
+
+   private:
+    const AbstractGrmManager& grm_;
+    RewriteContext* context_;
+
+    ContextPin(const ContextPin&) = delete;
+    ContextPin& operator=(const ContextPin&) = delete;
+  };
+
+  // Returns the handle's rules, bound anew for the context if they cannot be
+  // shared between threads. This does not pin the handle's generation in the
+  // context, which the handle keeps alive.
+  static const BoundRule* Bind(const RuleHandle& handle,
+                               RewriteContext* context);
+
+  // Rewrites with bound rules, using the context's scratch space.
+
+  static bool RewriteBytes(const BoundRule& rule, std::string_view input,
+                           RewriteContext* context, std::string* output);
+
+  static bool RewriteBytes(const BoundRule& rule, const Transducer& input,
+                           RewriteContext* context, std::string* output);
+
+  // Rewrites the labels in [begin, end), appending the output labels to the
+  // container.
+  template <typename Iterator, typename Container>
+  static bool RewriteLabels(const BoundRule& rule, Iterator begin,
+                            Iterator end, RewriteContext* context,
+                            Container* output);
+
+  // As above, binding the rules in the calling thread's context, and
+  // replacing the contents of the container.
+  template <typename Iterator, typename Container>
+  bool RewriteLabelRange(std::string_view rule, Iterator begin, Iterator end,
+                         Container* output, std::string_view pdt_parens_rule,
+                         std::string_view mpdt_assignments_rule) const;
+
+  // As above, storing the output as UTF-8.
+  template <typename Iterator>
+  bool RewriteLabelsToUtf8(std::string_view rule, Iterator begin,
+                           Iterator end, std::string* output,
+                           std::string_view pdt_parens_rule,
+                           std::string_view mpdt_assignments_rule) const;
+
+  // Appends labels to a string as UTF-8, as a container for the functions
+  // above, noting whether any label was not a codepoint.
+  class Utf8Appender {
+   public:
+    using value_type = Label;
+
+    explicit Utf8Appender(std::string* output) : output_(output) {}
+
+    size_t size() const { return output_->size(); }
+
+    void resize(size_t size) { output_->resize(size); }
+
+    void push_back(Label label);
+
+    bool Error() const { return error_; }
+
+   private:
+    std::string* output_;
+    bool error_ = false;
+  };
+
+  // Replaces the output by the composition of the input with the rule,
+  // trimmed if connect is true. The output must not be the input.
+  static bool Rewrite(const BoundRule& rule, const Transducer& input,
+                      RewriteContext* context, ::fst::MutableFst<Arc>* output,
+                      bool connect = true);
+
+  // Expands the composition of the FSTs into the output using the given
+  // matcher and filter. The second FST's matcher, if non-null, is taken over.
+  // Returns false if the composition is in error.
+  template <typename Matcher, typename Filter>
+  static bool ExpandCompose(const Transducer& fst1, const Transducer& fst2,
+                            ::fst::MutableFst<Arc>* output,
+                            Matcher* matcher2 = nullptr);
+
+  static std::unique_ptr<RewriteCache> MakeCache(
+      const GrmManagerOptions& opts);
+
+  // Appends the generation's identity to a cache key.
+  static void AppendGenerationKey(const Generation& generation,
+                                  std::string* key);
+
+  // As RewriteBytes() with bound rules, but consulting the result cache. As
+  // walking a sequential rule costs no more than a lookup, they bypass it.
+  bool CachedRewriteBytes(const BoundRule& rule, std::string_view input,
+                          RewriteContext* context, std::string* output) const;
+
+  // Looks the input up in the cache under the prefix the caller has placed in
+  // the context's cache key, calling rewrite() and caching its outcome on a
+  // miss. The cache must exist.
+  template <typename Rewriter>
+  bool RewriteThroughCache(std::string_view input, RewriteContext* context,
+                           std::string* output, Rewriter rewrite) const;
+
+  // Rewrites a batch of inputs as described for RewriteBatch(). Each worker
+  // calls make_rewriter() once to obtain a function object, taking an input
+  // and an output string, which holds that worker's state.
+  template <typename MakeRewriter>
+  static size_t RunBatch(const std::vector<std::string_view>& inputs,
+                         std::vector<std::string>* outputs,
+                         std::vector<bool>* succeeded, ThreadPool* pool,
+                         MakeRewriter make_rewriter);
+
+  // Identifies the manager uniquely within the process, so that threads can
+  // keep a context for each manager.
+  const uint64_t id_;
+
+  // The current generation. It is only accessed atomically, except by the
+  // compile-time functions documented as such.
+  std::shared_ptr<Generation> generation_;
+
+  // The address of the current generation, which lets contexts holding it
+  // check that it is still current without touching its reference count.
+  std::atomic<const Generation*> current_generation_;
+
+  // Serializes writers which derive a new generation from the current one.
+  std::mutex writer_mutex_;
+
+  std::unique_ptr<RewriteCache> cache_;
+
+  // Shared with lazily loaded generations, which intern as they read.
+  std::shared_ptr<SymbolTablePool> symbol_pool_ =
+      std::make_shared<SymbolTablePool>();
+
+  // Null unless statistics are being collected.
+  std::unique_ptr<RuleStatsCollector> rule_stats_;
+
+  AbstractGrmManager(const AbstractGrmManager&) = delete;
+  AbstractGrmManager& operator=(const AbstractGrmManager&) = delete;
+};
+
+template <typename Arc>
+class AbstractGrmManager<Arc>::RewriteContext {
+ public:
+  RewriteContext() = default;
+
+ private:
+  friend class AbstractGrmManager;
+  friend class RuleCascade<Arc>;
+
+  // Scratch FSTs draw their states and arcs from memory pools, which retain
+  // the memory released by DeleteStates() for the next rewrite.
+  using ScratchTransducer = ::fst::VectorFst<
+      Arc, ::fst::VectorState<Arc, ::fst::PoolAllocator<Arc>>>;
+
+  struct Entry {
+    std::string rule;
+    std::string pdt_parens_rule;
+    std::string mpdt_assignments_rule;
+    BoundRule bound;
+  };
+
+  // Makes the manager's current generation the one rules are bound in, unless
+  // it already is. The rules bound in the generation last used are kept if it
+  // is still current.
+  void Pin(const AbstractGrmManager& grm) {
+    const auto* current =
+        grm.current_generation_.load(std::memory_order_acquire);
+    if (current == generation_.get()) return;
+    if (!generation_) {
+      generation_ = last_generation_.lock();
+      if (current == generation_.get()) return;
+    }
+    Pin(grm.GetGeneration());
+  }
+
+  void Pin(std::shared_ptr<const Generation> generation) {
+    if (generation == generation_) return;
+    const bool rebind =
+        generation_ || generation != last_generation_.lock();
+    generation_ = std::move(generation);
+    if (!rebind) return;
+    last_generation_ = generation_;
+    entries_.clear();
+    derived_.clear();
+  }
+
+  // Releases the generation pinned by Pin(), so that an idle thread does not
+  // keep it alive. Its bound rules are kept for the next rewrite unless a
+  // newer generation has been published in the meantime.
+  void Unpin(const AbstractGrmManager& grm) {
+    if (grm.current_generation_.load(std::memory_order_acquire) !=
+        generation_.get()) {
+      entries_.clear();
+      derived_.clear();
+      last_generation_.reset();
+    }
+    generation_.reset();
+  }
+
+  // Returns the handle's rules bound for use by the context's thread. The
+  // pointer is valid until a few other handles have been bound.
+  const BoundRule* Bind(const RuleHandle& handle) {
+    // Handles are only bound here if their rules cannot be shared, which is
+    // rare, so only the few used last are kept.
+    static constexpr size_t kMaxHandleEntries = 8;
+    for (const auto& [id, bound] : handle_entries_) {
+      if (id == handle.id_) return &bound;
+    }
+    BoundRule bound;
+    if (!AbstractGrmManager::Bind(*handle.generation_, handle.rule_,
+                                  handle.pdt_parens_rule_,
+                                  handle.mpdt_assignments_rule_, &bound)) {
+      return nullptr;
+    }
+    if (handle_entries_.size() == kMaxHandleEntries) {
+      handle_entries_.pop_front();
+    }
+    handle_entries_.emplace_back(handle.id_, std::move(bound));
+    return &handle_entries_.back().second;
+  }
+
+  // Returns the rules bound in the pinned generation, or nullptr if one of
+  // them cannot be found. The pointer is valid until the context is pinned to
+  // another generation.
+  const BoundRule* Bind(std::string_view rule,
+                        std::string_view pdt_parens_rule,
+                        std::string_view mpdt_assignments_rule) {
+    for (const auto& entry : entries_) {
+      if (entry.rule == rule && entry.pdt_parens_rule == pdt_parens_rule &&
+          entry.mpdt_assignments_rule == mpdt_assignments_rule) {
+        return &entry.bound;
+      }
+    }
+    BoundRule bound;
+    if (!AbstractGrmManager::Bind(*generation_, rule, pdt_parens_rule,
+                                  mpdt_assignments_rule, &bound)) {
+      return nullptr;
+    }
+    entries_.push_back({std::string(rule), std::string(pdt_parens_rule),
+                        std::string(mpdt_assignments_rule), std::move(bound)});
+    return &entries_.back().bound;
+  }
+
+  // As Generation::GetDerived(), for the pinned generation, but only taking
+  // the generation's lock the first time the context asks for the key.
+  template <typename T, typename Make>
+  const T* GetDerived(std::string_view key, Make make) {
+    for (const auto& key_and_derived : derived_) {
+      if (key_and_derived.first == key) {
+        return static_cast<const T*>(key_and_derived.second);
+      }
+    }
+    const T* derived = generation_->template GetDerived<T>(key, make);
+    derived_.emplace_back(std::string(key), derived);
+    return derived;
+  }
+
+  // Compiles the byte string into the input scratch FST.
+  void CompileBytes(std::string_view input) {
+    const auto* begin = reinterpret_cast<const unsigned char*>(input.data());
+    CompileLabels(begin, begin + input.size());
+  }
+
+  // Compiles the labels in [begin, end) into the input scratch FST.
+  template <typename Iterator>
+  void CompileLabels(Iterator begin, Iterator end) {
+    input_.DeleteStates();
+    auto state = input_.AddState();
+    input_.SetStart(state);
+    for (; begin != end; ++begin) {
+      const Label label = *begin;
+      const auto next = input_.AddState();
+      input_.AddArc(state, Arc(label, label, Arc::Weight::One(), next));
+      state = next;
+    }
+    input_.SetFinal(state, Arc::Weight::One());
+  }
+
+  // Appends the output labels of the shortest path through the lattice to the
+  // container. Returns false if the lattice has no successful path.
+  template <typename Container>
+  bool AppendShortestPath(const Transducer& lattice, Container* output) {
+    if constexpr ((Arc::Weight::Properties() & ::fst::kPath) != 0) {
+      return ::fst::BestPath(lattice, output, nullptr, &best_path_);
+    } else {
+      MutableTransducer path(lattice);
+      StringifyFst(&path);
+      auto state = path.Start();
+      if (state == ::fst::kNoStateId) return false;
+      // The path is now a chain of non-epsilon output labels.
+      while (path.NumArcs(state) > 0) {
+        ::fst::ArcIterator<MutableTransducer> aiter(path, state);
+        output->push_back(
+            static_cast<typename Container::value_type>(aiter.Value().olabel));
+        state = aiter.Value().nextstate;
+      }
+      return true;
+    }
+  }
+
+  // Prints the output side of the shortest path through the lattice as a byte
+  // string. Returns false if the lattice has no successful path.
+  bool PrintShortestPath(const Transducer& lattice, std::string* output) {
+    if constexpr ((Arc::Weight::Properties() & ::fst::kPath) != 0) {
+      const auto size = output->size();
+      if (!::fst::BestPath(lattice, output, nullptr, &best_path_)) {
+        return false;
+      }
+      output->erase(0, size);
+      return true;
+    } else {
+      MutableTransducer path(lattice);
+      StringifyFst(&path);
+      if (path.Start() == ::fst::kNoStateId) return false;
+      static const ::fst::StringPrinter<Arc> printer(
+          ::fst::TokenType::BYTE);
+      return printer(path, output);
+    }
+  }
+
+  // Set while a rewrite is in progress.
+  std::shared_ptr<const Generation> generation_;
+  // The generation the entries were bound in.
+  std::weak_ptr<const Generation> last_generation_;
+  // The number of ContextPin guards on the stack.
+  int pin_depth_ = 0;
+  // Entries are never moved, so that bound rules have stable addresses.
+  std::deque<Entry> entries_;
+  // Rules bound for handles, by handle ID.
+  std::deque<std::pair<uint64_t, BoundRule>> handle_entries_;
+  // Objects derived from the pinned generation, by key.
+  std::vector<std::pair<std::string, const void*>> derived_;
+  // Scratch stage list for RuleCascade.
+  std::vector<const BoundRule*> stages_;
+  // Scratch result cache key.
+  std::string cache_key_;
+  // Scratch labels decoded from a UTF-8 input.
+  std::vector<Label> labels_;
+  // The statistics of the rewrite being recorded, if any.
+  RuleStats* recording_ = nullptr;
+  ScratchTransducer input_;
+  // The input relabeled for a lookahead rule.
+  ScratchTransducer lookahead_input_;
+  ScratchTransducer lattice_;
+  // Intermediate lattices for RuleCascade.
+  ScratchTransducer stage_lattices_[2];
+  ::fst::BestPathBuffers<Arc> best_path_;
+
+  RewriteContext(const RewriteContext&) = delete;
+  RewriteContext& operator=(const RewriteContext&) = delete;
+};
+
+template <typename Arc>
+class AbstractGrmManager<Arc>::RuleHandle {
+ public:
+  // The generation the rules were resolved in.
+  const Generation& GetGeneration() const { return *generation_; }
+
+ private:
+  friend class AbstractGrmManager;
+  friend class RewriteContext;
+
+  RuleHandle() {
+    static std::atomic<uint64_t> next_id(0);
+    id_ = next_id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Identifies the handle among those bound by a context.
+  uint64_t id_;
+  std::shared_ptr<const Generation> generation_;
+  std::string rule_;
+  std::string pdt_parens_rule_;
+  std::string mpdt_assignments_rule_;
+  BoundRule bound_;
+
+  RuleHandle(const RuleHandle&) = delete;
+  RuleHandle& operator=(const RuleHandle&) = delete;
+};
+
+template <typename Arc>
+class AbstractGrmManager<Arc>::StreamRewriter {
+ public:
+  // Appends the chunk to the stream, rewriting and emitting every segment
+  // known to be complete. Returns false if the stream has failed.
+  bool Feed(std::string_view chunk);
+
+  // Rewrites and emits the rest of the stream. Returns false if the stream has
+  // failed.
+  bool Finish();
+
+  // The number of segments passed through unchanged because they could not
+  // be rewritten.
+  size_t NumFailedSegments() const { return num_failed_segments_; }
+
+ private:
+  friend class AbstractGrmManager;
+
+  using StateId = typename Arc::StateId;
+
+  StreamRewriter(const AbstractGrmManager& grm,
+                 const StreamRewriteOptions& opts,
+                 std::function<bool(std::string_view)> emit)
+      : grm_(grm), opts_(opts), emit_(std::move(emit)) {}
+
+  // Rewrites and emits the segments found by scanning the buffer. Unless
+  // finishing, scanning stops where a boundary might continue into input not
+  // yet seen, or, if the buffer has outgrown the segment size, cuts the
+  // boundaries still being matched short at its end.
+  bool Process(bool finish);
+
+  // Runs the boundary matcher over the next byte of the buffer.
+  void Step();
+
+  // Adds a thread in the state, and in the states reachable from it by input
+  // epsilons, for the start position, unless earlier ones are there already.
+  void AddThread(StateId state, size_t start,
+                 std::vector<std::pair<StateId, size_t>>* threads) const;
+
+  // Moves the scan up to the position, none of the bytes passed starting a
+  // boundary.
+  bool SkipTo(size_t pos);
+
+  // Moves the scan past the boundary found, which ends at the position.
+  bool PassBoundary(size_t pos);
+
+  // Rewrites and emits the first size bytes of the buffer, and drops them.
+  bool Emit(size_t size);
+
+  const AbstractGrmManager& grm_;
+  const StreamRewriteOptions opts_;
+  const std::function<bool(std::string_view)> emit_;
+  RewriteContext context_;
+  const BoundRule* rule_ = nullptr;
+  const BoundRule* boundary_ = nullptr;
+  // Input not yet emitted; all of it before scan_ has been scanned for
+  // boundaries, the last of which ends at last_boundary_ (or 0 if none).
+  std::string buffer_;
+  size_t scan_ = 0;
+  size_t last_boundary_ = 0;
+  // The boundary matcher runs over all start positions at once, so each byte
+  // is read once however long the boundaries tried. It has read the buffer
+  // up to match_pos_, and its threads hold the boundary rule states reached
+  // from the start positions not yet decided, at most one for each state
+  // (that of the earliest start), in order of start. If a boundary has been
+  // found, the longest starting where the earliest one does is held until no
+  // thread starting as early remains.
+  size_t match_pos_ = 0;
+  std::vector<std::pair<StateId, size_t>> threads_;
+  bool matched_ = false;
+  size_t match_start_ = 0;
+  size_t match_end_ = 0;
+  bool failed_ = false;
+  size_t num_failed_segments_ = 0;
+  // Scratch storage.
+  std::string output_;
+  std::vector<std::pair<StateId, size_t>> next_threads_;
+
+  StreamRewriter(const StreamRewriter&) = delete;
+  StreamRewriter& operator=(const StreamRewriter&) = delete;
+};
+
+namespace internal {
+
+inline uint64_t NextGrmManagerId() {
+  static std::atomic<uint64_t> next_id(0);
+  return next_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+}  // namespace internal
+
+template <typename Arc>
+AbstractGrmManager<Arc>::AbstractGrmManager()
+    : id_(internal::NextGrmManagerId()),
+      generation_(std::make_shared<Generation>()),
+      current_generation_(generation_.get()) {}
+
+template <typename Arc>
+AbstractGrmManager<Arc>::AbstractGrmManager(const GrmManagerOptions& opts)
+    : opts_(opts),
+      id_(internal::NextGrmManagerId()),
+      generation_(std::make_shared<Generation>()),
+      current_generation_(generation_.get()),
+      cache_(MakeCache(opts)),
+      rule_stats_(opts.collect_rule_stats
+                      ? std::make_unique<RuleStatsCollector>()
+                      : nullptr) {}
+
+template <typename Arc>
+AbstractGrmManager<Arc>::~AbstractGrmManager() {
+}
+
+template <typename Arc>
+template <typename FarReader>
+bool AbstractGrmManager<Arc>::LoadArchive(FarReader* reader,
+                                          std::string_view filename) {
+  auto generation = std::make_shared<Generation>();
+  auto& fsts = generation->fsts_;
+  for (reader->Reset(); !reader->Done(); reader->Next()) {
+    const auto& name = reader->GetKey();
+    const auto* fst = reader->GetFst();
+    if (!fst) {
+      LOG(ERROR) << "Unable to read rule " << name << " from " << filename;
+      return false;
+    }
+    // Expanded FSTs are shallow-copied, which for mapped ConstFsts keeps them
+    // backed by the mapping; anything else is converted to a VectorFst.
+    if (IsExpanded(*fst)) {
+      fsts[name] = fst::WrapUnique(fst->Copy());
+    } else {
+      fsts[name] = std::make_unique<MutableTransducer>(*fst);
+    }
+  }
+  if (fsts.size() == 0) {
+    LOG(ERROR) << filename << " is an empty FAR: Did you `export` any rules?";
+    return false;
+  }
+  const auto pool = MakeLoadPool(fsts.size());
+  PrepareGeneration(generation.get(), pool.get());
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  Publish(std::move(generation));
+  return true;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::LoadArchive(const IndexedFarReader<Arc>& reader,
+                                          std::string_view filename) {
+  if (reader.NumEntries() == 0) {
+    LOG(ERROR) << filename << " is an empty FAR: Did you `export` any rules?";
+    return false;
+  }
+  // The entries holding rules: those listed by the manifest of a prepared
+  // archive, or all of them.
+  PreparedFarManifest manifest;
+  const bool prepared = ReadManifest(reader, filename, &manifest);
+  std::vector<size_t> entries;
+  if (prepared) {
+    for (const auto& rule : manifest.rules) {
+      entries.push_back(reader.Find(rule.name));
+    }
+  } else {
+    // The artifacts of an archive whose manifest is unusable are not rules.
+    for (size_t i = 0; i < reader.NumEntries(); ++i) {
+      if (!IsPreparedArtifactKey(reader.Key(i))) entries.push_back(i);
+    }
+  }
+  const auto num_rules = entries.size();
+  const auto pool = MakeLoadPool(num_rules);
+  // Each rule is read into its own slot, so the result does not depend on the
+  // order in which the workers finish.
+  std::vector<std::unique_ptr<const Transducer>> rules(num_rules);
+  std::vector<std::unique_ptr<LookAheadRule>> lookahead_rules(num_rules);
+  ParallelFor(pool.get(), num_rules, [&](size_t i) {
+    std::unique_ptr<const Transducer> fst = reader.ReadFst(entries[i]);
+    // As in the sequential LoadArchive().
+    if (fst && !IsExpanded(*fst)) {
+      fst = std::make_unique<MutableTransducer>(*fst);
+    }
+    if (fst && prepared) {
+      const auto& rule = manifest.rules[i];
+      if (opts_.verify_prepared_far &&
+          FstFingerprint(*fst) != rule.fingerprint) {
+        LOG(ERROR) << "Rule " << rule.name << " does not match the manifest";
+        fst.reset();
+      } else if (rule.lookahead && opts_.label_lookahead) {
+        // Failing that, the lookahead form is rebuilt as for other archives.
+        auto lookahead_fst = reader.template ReadFstAs<LookAheadTransducer>(
+            reader.Find(kPreparedLookAheadPrefix + rule.name));
+        if (lookahead_fst) {
+          lookahead_rules[i] = MakeLookAheadRule(std::move(lookahead_fst));
+        }
+      }
+    }
+    rules[i] = std::move(fst);
+  });
+  auto generation = std::make_shared<Generation>();
+  for (size_t i = 0; i < num_rules; ++i) {
+    const auto& name = reader.Key(entries[i]);
+    if (!rules[i]) {
+      LOG(ERROR) << "Unable to read rule " << name << " from " << filename;
+      return false;
+    }
+    generation->fsts_[name] = std::move(rules[i]);
+    if (lookahead_rules[i]) {
+      generation->template GetDerived<LookAheadRule>(
+          LookAheadKey(name),
+          [&rule = lookahead_rules[i]] { return std::move(rule); });
+    }
+  }
+  PrepareGeneration(generation.get(), pool.get(), prepared);
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  Publish(std::move(generation));
+  return true;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::LoadArchiveLazily(
+    std::unique_ptr<IndexedFarReader<Arc>> reader, std::string_view filename) {
+  const auto num_rules = reader->NumEntries();
+  if (num_rules == 0) {
+    LOG(ERROR) << filename << " is an empty FAR: Did you `export` any rules?";
+    return false;
+  }
+  auto generation = std::make_shared<Generation>();
+  auto lazy = std::make_unique<typename Generation::LazyArchive>();
+  lazy->reader = std::move(reader);
+  lazy->filename = std::string(filename);
+  lazy->opts = opts_;
+  lazy->symbol_pool = symbol_pool_;
+  lazy->rules = std::make_unique<typename Generation::LazyRule[]>(num_rules);
+  generation->lazy_ = std::move(lazy);
+  for (const auto& name : opts_.preload_rules) {
+    if (!generation->GetFst(name)) {
+      LOG(ERROR) << "Unable to preload rule " << name << " from " << filename;
+      return false;
+    }
+  }
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  Publish(std::move(generation));
+  return true;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::ReadManifest(const IndexedFarReader<Arc>& reader,
+                                           std::string_view filename,
+                                           PreparedFarManifest* manifest) {
+  const auto index = reader.Find(kPreparedFarManifestKey);
+  if (index == reader.NumEntries()) return false;
+  const auto fst = reader.ReadFst(index);
+  if (!fst || !manifest->template FromFst<Arc>(*fst)) {
+    LOG(WARNING) << "Ignoring unusable manifest of prepared archive "
+                 << filename;
+    return false;
+  }
+  for (const auto& rule : manifest->rules) {
+    if (reader.Find(rule.name) == reader.NumEntries() ||
+        (rule.lookahead &&
+         reader.Find(kPreparedLookAheadPrefix + rule.name) ==
+             reader.NumEntries())) {
+      LOG(WARNING) << "Ignoring manifest of prepared archive " << filename
+                   << ", which lists missing rule " << rule.name;
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Arc>
+const typename AbstractGrmManager<Arc>::Transducer*
+AbstractGrmManager<Arc>::Generation::GetLazyFst(std::string_view name) const {
+  if (IsPreparedArtifactKey(name)) return nullptr;
+  auto& lazy = *lazy_;
+  const auto index = lazy.reader->Find(name);
+  if (index == lazy.reader->NumEntries()) return nullptr;
+  auto& rule = lazy.rules[index];
+  std::call_once(rule.once, [&] {
+    std::unique_ptr<const Transducer> fst = lazy.reader->ReadFst(index);
+    if (!fst) {
+      LOG(ERROR) << "Unable to read rule " << name << " from "
+                 << lazy.filename;
+      return;
+    }
+    // As in LoadArchive().
+    if (!IsExpanded(*fst)) fst = std::make_unique<MutableTransducer>(*fst);
+    PrepareRule(&fst);
+    if (lazy.opts.intern_symbols) {
+      InternSymbols(lazy.symbol_pool.get(), &fst, &symbol_tables_);
+    }
+    if (lazy.opts.compact_rules) {
+      // Rules are compacted concurrently; only the statistics are shared.
+      CompactionStats stats;
+      CompactRule(name, &fst, &stats);
+      std::lock_guard<std::mutex> lock(stats_mutex_);
+      compaction_stats_.num_rules += stats.num_rules;
+      compaction_stats_.num_compacted += stats.num_compacted;
+      compaction_stats_.bytes_before += stats.bytes_before;
+      compaction_stats_.bytes_after += stats.bytes_after;
+    }
+    PrepareMatchers(lazy.opts, *this, name, *fst);
+    rule.fst = std::move(fst);
+  });
+  return rule.fst.get();
+}
+
+template <typename Arc>
+const typename AbstractGrmManager<Arc>::FstMap&
+AbstractGrmManager<Arc>::Generation::GetFstMap() const {
+  if (!lazy_) return fsts_;
+  auto& lazy = *lazy_;
+  std::call_once(lazy.all_once, [&] {
+    for (size_t i = 0; i < lazy.reader->NumEntries(); ++i) {
+      const auto& name = lazy.reader->Key(i);
+      if (IsPreparedArtifactKey(name)) continue;
+      if (const auto* fst = GetFst(name)) {
+        lazy.all.emplace(name, fst::WrapUnique(fst->Copy()));
+      }
+    }
+  });
+  return lazy.all;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::IsExpanded(const Transducer& fst) {
+  const auto& type = fst.Type();
+  return type == "vector" || type.compare(0, 5, "const") == 0;
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::LoadFstMap(FstMap named_fsts) {
+  for (const auto& key_and_fst : named_fsts) {
+    CHECK_NE(key_and_fst.second, nullptr);
+  }
+  auto generation = std::make_shared<Generation>();
+  generation->fsts_ = std::move(named_fsts);
+  const auto pool = MakeLoadPool(generation->fsts_.size());
+  PrepareGeneration(generation.get(), pool.get());
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  Publish(std::move(generation));
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::SortRuleInputLabels() {
+  const auto pool = MakeLoadPool(generation_->fsts_.size());
+  PrepareRules(&generation_->fsts_, pool.get());
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::PrepareRule(
+    std::unique_ptr<const Transducer>* fst) {
+  // Arc-sorts if the FST is not known to be input-sorted.
+  if ((*fst)->Properties(::fst::kILabelSorted, false) !=
+      ::fst::kILabelSorted) {
+    auto sorted_fst = std::make_unique<MutableTransducer>(**fst);
+    static const ::fst::ILabelCompare<Arc> icomp;
+    ::fst::ArcSort(sorted_fst.get(), icomp);
+    *fst = std::move(sorted_fst);
+  }
+  // Computes the properties up front so that RewriteBytes() need only consult
+  // the cached values.
+  ::fst::IsSequential(**fst, /*test=*/true);
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::PrepareRules(FstMap* fsts, ThreadPool* pool) {
+  std::vector<std::unique_ptr<const Transducer>*> rules;
+  rules.reserve(fsts->size());
+  for (auto &pair : *fsts) rules.push_back(&pair.second);
+  ParallelFor(pool, rules.size(), [&rules](size_t i) {
+    PrepareRule(rules[i]);
+  });
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::InternSymbols(
+    SymbolTablePool* symbol_pool, std::unique_ptr<const Transducer>* fst,
+    SymbolTableRefs* refs) {
+  // Other types cannot have their tables replaced without copying them.
+  if ((*fst)->Type() != "vector") return;
+  if (!(*fst)->InputSymbols() && !(*fst)->OutputSymbols()) return;
+  // Taking over the rule's implementation, rather than sharing it, lets the
+  // tables be replaced without copying the states.
+  std::unique_ptr<MutableTransducer> rule(
+      static_cast<const MutableTransducer&>(**fst).Copy());
+  fst->reset();
+  symbol_pool->Intern(rule.get(), refs);
+  *fst = std::move(rule);
+}
+
+template <typename Arc>
+std::unique_ptr<ThreadPool> AbstractGrmManager<Arc>::MakeLoadPool(
+    size_t num_rules) const {
+  size_t num_threads = opts_.load_threads;
+  if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+  num_threads = std::min(num_threads, num_rules);
+  if (num_threads <= 1) return nullptr;
+  return std::make_unique<ThreadPool>(num_threads);
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::PrepareGeneration(Generation* generation,
+                                                ThreadPool* pool,
+                                                bool prepared) const {
+  if (!prepared) PrepareRules(&generation->fsts_, pool);
+  if (opts_.intern_symbols) {
+    std::vector<std::unique_ptr<const Transducer>*> rules;
+    for (auto& pair : generation->fsts_) rules.push_back(&pair.second);
+    ParallelFor(pool, rules.size(), [&](size_t i) {
+      InternSymbols(symbol_pool_.get(), rules[i],
+                    &generation->symbol_tables_);
+    });
+    VLOG(1) << "Symbol table pool holds " << symbol_pool_->Size()
+            << " tables";
+  }
+  CompactRules(generation, pool);
+  PrepareMatchers(*generation);
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::CompactRules(Generation* generation,
+                                           ThreadPool* pool) const {
+  if (!opts_.compact_rules) return;
+  std::vector<std::pair<std::string_view, std::unique_ptr<const Transducer>*>>
+      rules;
+  for (auto& [name, fst] : generation->fsts_) rules.emplace_back(name, &fst);
+  // Statistics are kept per rule and summed in order afterwards.
+  std::vector<CompactionStats> rule_stats(rules.size());
+  ParallelFor(pool, rules.size(), [&](size_t i) {
+    CompactRule(rules[i].first, rules[i].second, &rule_stats[i]);
+  });
+  auto& stats = generation->compaction_stats_;
+  for (const auto& rule : rule_stats) {
+    stats.num_rules += rule.num_rules;
+    stats.num_compacted += rule.num_compacted;
+    stats.bytes_before += rule.bytes_before;
+    stats.bytes_after += rule.bytes_after;
+  }
+  LOG(INFO) << "Compacted " << stats.num_compacted << " of " << stats.num_rules
+            << " rules: " << stats.bytes_before << " -> " << stats.bytes_after
+            << " bytes";
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::CompactRule(
+    std::string_view name, std::unique_ptr<const Transducer>* fst,
+    CompactionStats* stats) {
+  // Other types are either compact already or mapped from the archive.
+  if ((*fst)->Type() != "vector") return;
+  ++stats->num_rules;
+  const auto bytes_before = ::fst::VectorFstBytes(**fst);
+  size_t bytes_after = 0;
+  // Only built if it is smaller.
+  std::unique_ptr<const Transducer> compact =
+      ::fst::CompactCopy(**fst, &bytes_after, bytes_before);
+  stats->bytes_before += bytes_before;
+  if (!compact) {
+    stats->bytes_after += bytes_before;
+    return;
+  }
+  VLOG(1) << "Stored rule " << name << " as " << compact->Type() << ": "
+          << bytes_before << " -> " << bytes_after << " bytes";
+  stats->bytes_after += bytes_after;
+  ++stats->num_compacted;
+  *fst = std::move(compact);
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::PrepareMatchers(
+    const Generation& generation) const {
+  for (const auto& [name, fst] : generation.fsts_) {
+    PrepareMatchers(opts_, generation, name, *fst);
+  }
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::PrepareMatchers(const GrmManagerOptions& opts,
+                                              const Generation& generation,
+                                              std::string_view name,
+                                              const Transducer& fst) {
+  if (opts.label_lookahead && UsesLookAhead(fst)) {
+    generation.template GetDerived<LookAheadRule>(
+        LookAheadKey(name), [&fst] { return MakeLookAheadRule(fst); });
+  }
+  if (const auto min_arcs = opts.byte_table_min_arcs; min_arcs > 0) {
+    generation.template GetDerived<ByteTables>(
+        ByteTablesKey(name), [&fst, min_arcs] {
+          return std::make_unique<ByteTables>(fst, min_arcs);
+        });
+  }
+  if (opts.input_alphabets) {
+    generation.template GetDerived<InputAlphabet>(
+        InputAlphabetKey(name),
+        [&fst] { return std::make_unique<InputAlphabet>(fst); });
+  }
+}
+
+template <typename Arc>
+std::unique_ptr<typename AbstractGrmManager<Arc>::LookAheadRule>
+AbstractGrmManager<Arc>::MakeLookAheadRule(const Transducer& fst) {
+  return MakeLookAheadRule(std::make_unique<LookAheadTransducer>(fst));
+}
+
+template <typename Arc>
+std::unique_ptr<typename AbstractGrmManager<Arc>::LookAheadRule>
+AbstractGrmManager<Arc>::MakeLookAheadRule(
+    std::unique_ptr<const LookAheadTransducer> lookahead_fst) {
+  static constexpr Label kNumBytes = 256;
+  std::vector<std::pair<Label, Label>> pairs;
+  ::fst::LabelLookAheadRelabeler<Arc>::RelabelPairs(*lookahead_fst, &pairs);
+  auto rule = std::make_unique<LookAheadRule>();
+  rule->unknown_label = 1;
+  for (const auto& [label, index] : pairs) {
+    rule->unknown_label = std::max(rule->unknown_label, index + 1);
+  }
+  rule->byte_labels.assign(kNumBytes, rule->unknown_label);
+  for (const auto& [label, index] : pairs) {
+    if (label >= 0 && label < kNumBytes) {
+      rule->byte_labels[label] = index;
+    } else {
+      rule->other_labels[label] = index;
+    }
+  }
+  // Epsilons are never relabeled.
+  rule->byte_labels[0] = 0;
+  rule->fst = std::move(lookahead_fst);
+  return rule;
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::Publish(std::shared_ptr<Generation> generation) {
+  const Generation* current = generation.get();
+  std::atomic_store(&generation_, std::move(generation));
+  current_generation_.store(current, std::memory_order_release);
+  // Results cached for earlier generations can no longer be hit, as their keys
+  // include the generation, so this only reclaims the memory.
+  if (cache_) cache_->Clear();
+}
+
+template <typename Arc>
+std::unique_ptr<RewriteCache> AbstractGrmManager<Arc>::MakeCache(
+    const GrmManagerOptions& opts) {
+  if (opts.rewrite_cache_bytes == 0) return nullptr;
+  return std::make_unique<RewriteCache>(opts.rewrite_cache_bytes);
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::AppendGenerationKey(const Generation& generation,
+                                                  std::string* key) {
+  const auto id = generation.Id();
+  key->append(reinterpret_cast<const char*>(&id), sizeof(id));
+}
+
+template <typename Arc>
+typename AbstractGrmManager<Arc>::RewriteContext*
+AbstractGrmManager<Arc>::ThreadLocalContext() const {
+  // Most threads use one or two managers, so only the few used last keep
+  // their contexts, most recent first. Contexts in use further up the stack
+  // are never dropped.
+  static constexpr size_t kMaxContexts = 4;
+  static thread_local std::vector<
+      std::pair<uint64_t, std::unique_ptr<RewriteContext>>>
+      contexts;
+  for (size_t i = 0; i < contexts.size(); ++i) {
+    if (contexts[i].first == id_) {
+      std::rotate(contexts.begin(), contexts.begin() + i,
+                  contexts.begin() + i + 1);
+      return contexts.front().second.get();
+    }
+  }
+  if (contexts.size() >= kMaxContexts) {
+    for (size_t i = contexts.size(); i-- > 0;) {
+      if (contexts[i].second->pin_depth_ == 0) {
+        contexts.erase(contexts.begin() + i);
+        break;
+      }
+    }
+  }
+  contexts.emplace(contexts.begin(), id_, std::make_unique<RewriteContext>());
+  return contexts.front().second.get();
+}
+
+template <typename Arc>
+AbstractGrmManager<Arc>::ContextPin::ContextPin(const AbstractGrmManager& grm,
+                                                RewriteContext* context)
+    : grm_(grm), context_(context) {
+  if (context_->pin_depth_++ == 0) context_->Pin(grm_);
+}
+
+template <typename Arc>
+AbstractGrmManager<Arc>::ContextPin::ContextPin(
+    const AbstractGrmManager& grm,
+    std::shared_ptr<const Generation> generation, RewriteContext* context)
+    : grm_(grm), context_(context) {
+  if (context_->pin_depth_++ == 0) context_->Pin(std::move(generation));
+}
+
+template <typename Arc>
+AbstractGrmManager<Arc>::ContextPin::~ContextPin() {
+  if (--context_->pin_depth_ == 0) context_->Unpin(grm_);
+}
+
+template <typename Arc>
+const typename AbstractGrmManager<Arc>::Transducer*
+AbstractGrmManager<Arc>::GetFst(std::string_view name) const {
+  return GetGeneration()->GetFst(name);
+}
+
+template <typename Arc>
+std::unique_ptr<typename AbstractGrmManager<Arc>::Transducer>
+AbstractGrmManager<Arc>::GetFstSafe(std::string_view name) const {
+  return GetGeneration()->GetFstSafe(name);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::SetFst(std::string_view name,
+                                     const Transducer& input) {
+  std::lock_guard<std::mutex> lock(writer_mutex_);
+  const auto current = GetGeneration();
+  if (!current->GetFst(name)) return false;
+  // The other rules are shallow-copied into the new generation. (Rules not
+  // yet read from a lazily loaded archive are read now.)
+  auto generation = std::make_shared<Generation>();
+  for (const auto& key_and_fst : current->GetFstMap()) {
+    if (key_and_fst.first == name) {
+      std::unique_ptr<const Transducer> fst(input.Copy(true));
+      PrepareRule(&fst);
+      if (opts_.intern_symbols) {
+        InternSymbols(symbol_pool_.get(), &fst, &generation->symbol_tables_);
+      }
+      generation->fsts_.emplace(key_and_fst.first, std::move(fst));
+    } else {
+      generation->fsts_.emplace(key_and_fst.first,
+                                fst::WrapUnique(key_and_fst.second->Copy()));
+      // The unchanged rules keep their lookahead forms, byte tables, input
+      // alphabets and domain acceptors.
+      std::lock_guard<std::mutex> derived_lock(current->derived_mutex_);
+      for (const auto& key : {LookAheadKey(key_and_fst.first),
+                              ByteTablesKey(key_and_fst.first),
+                              InputAlphabetKey(key_and_fst.first),
+                              DomainKey(key_and_fst.first)}) {
+        const auto it = current->derived_.find(key);
+        if (it != current->derived_.end()) {
+          generation->derived_.emplace(key, it->second);
+        }
+      }
+    }
+  }
+  // The copied rules share the tables of those they were copied from.
+  generation->symbol_tables_.Add(current->symbol_tables_);
+  PrepareMatchers(*generation);
+  Publish(std::move(generation));
+  return true;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::Bind(const Generation& generation,
+                                   std::string_view rule,
+                                   std::string_view pdt_parens_rule,
+                                   std::string_view mpdt_assignments_rule,
+                                   BoundRule* bound) {
+  const auto* fst = generation.GetFst(rule);
+  if (!fst) {
+    LOG(ERROR) << "Rule " << rule << " not found.";
+    return false;
+  }
+  bound->thread_safe = IsExpanded(*fst);
+  if (bound->thread_safe) {
+    bound->owned_fst.reset();
+    bound->fst = fst;
+  } else {
+    bound->owned_fst = fst::WrapUnique(fst->Copy(true));
+    bound->fst = bound->owned_fst.get();
+  }
+  if (!pdt_parens_rule.empty() && !generation.GetFst(pdt_parens_rule)) {
+    LOG(ERROR) << "PDT parentheses rule " << pdt_parens_rule << " not found.";
+    return false;
+  }
+  if (!mpdt_assignments_rule.empty() &&
+      !generation.GetFst(mpdt_assignments_rule)) {
+    LOG(ERROR) << "MPDT assignments rule " << mpdt_assignments_rule
+               << " not found.";
+    return false;
+  }
+  bound->pdt_metadata = nullptr;
+  bound->mpdt = false;
+  if (!pdt_parens_rule.empty()) {
+    std::string key = "pdt:";
+    key.append(pdt_parens_rule);
+    key.push_back('\0');
+    key.append(mpdt_assignments_rule);
+    bound->pdt_metadata =
+        generation.template GetDerived<PdtMetadata>(key, [&] {
+          auto metadata = std::make_unique<PdtMetadata>();
+          MakeParensPairVector(*generation.GetFstSafe(pdt_parens_rule),
+                               &metadata->parens);
+          if (!mpdt_assignments_rule.empty()) {
+            MakeAssignmentsVector(
+                *generation.GetFstSafe(mpdt_assignments_rule),
+                metadata->parens, &metadata->assignments);
+          }
+          return metadata;
+        });
+    bound->mpdt = !mpdt_assignments_rule.empty();
+  }
+  bound->lookahead =
+      bound->pdt_metadata
+          ? nullptr
+          : generation.template FindDerived<LookAheadRule>(LookAheadKey(rule));
+  bound->owned_byte_tables.reset();
+  bound->byte_tables =
+      bound->pdt_metadata ? nullptr
+                          : generation.template FindDerived<ByteTables>(
+                                ByteTablesKey(rule));
+  // The alphabet of a PDT, read as an FST, is a superset of the labels it can
+  // match, so it may still be used to reject inputs.
+  bound->owned_alphabet.reset();
+  bound->alphabet =
+      generation.template FindDerived<InputAlphabet>(InputAlphabetKey(rule));
+  bound->sequential =
+      !bound->pdt_metadata && ::fst::IsSequential(*bound->fst);
+  bound->name.assign(rule.data(), rule.size());
+  // Rule names cannot contain NULs, so these keys are unambiguous.
+  bound->cache_key.clear();
+  AppendGenerationKey(generation, &bound->cache_key);
+  bound->cache_key.push_back('r');
+  for (const auto name : {rule, pdt_parens_rule, mpdt_assignments_rule}) {
+    bound->cache_key.append(name);
+    bound->cache_key.push_back('\0');
+  }
+  return true;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteBytes(
+    std::string_view rule, std::string_view input, std::string* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  return RewriteBytes(ThreadLocalContext(), rule, input, output,
+                      pdt_parens_rule, mpdt_assignments_rule);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteBytes(
+    RewriteContext* context, std::string_view rule, std::string_view input,
+    std::string* output, std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  const ContextPin pin(*this, context);
+  const auto* bound =
+      context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  return bound && Record(rule, context, output, [&] {
+           return CachedRewriteBytes(*bound, input, context, output);
+         });
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::CachedRewriteBytes(const BoundRule& rule,
+                                                 std::string_view input,
+                                                 RewriteContext* context,
+                                                 std::string* output) const {
+  // Inputs the rule cannot match are rejected before the cache is consulted.
+  if (rule.alphabet && !rule.alphabet->ContainsBytes(input)) return false;
+  if (!cache_ || rule.sequential) {
+    return RewriteBytes(rule, input, context, output);
+  }
+  context->cache_key_.assign(rule.cache_key);
+  return RewriteThroughCache(input, context, output, [&] {
+    return RewriteBytes(rule, input, context, output);
+  });
+}
+
+template <typename Arc>
+template <typename Rewriter>
+bool AbstractGrmManager<Arc>::RewriteThroughCache(std::string_view input,
+                                                  RewriteContext* context,
+                                                  std::string* output,
+                                                  Rewriter rewrite) const {
+  auto& key = context->cache_key_;
+  key.append(input);
+  bool success = false;
+  if (cache_->Lookup(key, output, &success)) return success;
+  success = rewrite();
+  cache_->Insert(key, success ? std::string_view(*output) : "", success);
+  return success;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteBytes(
+    std::string_view rule, const Transducer& input, std::string* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  auto* context = ThreadLocalContext();
+  const ContextPin pin(*this, context);
+  const auto* bound =
+      context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  return bound && Record(rule, context, output, [&] {
+           return RewriteBytes(*bound, input, context, output);
+         });
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteBytes(const BoundRule& rule,
+                                           std::string_view input,
+                                           RewriteContext* context,
+                                           std::string* output) {
+  if (rule.sequential) {
+    const auto size = output->size();
+    if (!::fst::SequentialApply(*rule.fst, input, output)) return false;
+    output->erase(0, size);
+    return true;
+  }
+  context->CompileBytes(input);
+  return RewriteBytes(rule, context->input_, context, output);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteBytes(const BoundRule& rule,
+                                           const Transducer& input,
+                                           RewriteContext* context,
+                                           std::string* output) {
+  // The lattice is not trimmed, as the best path does not depend on it.
+  if (!Rewrite(rule, input, context, &context->lattice_,
+               /*connect=*/false)) {
+    return false;
+  }
+  return context->PrintShortestPath(context->lattice_, output);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::Rewrite(
+    std::string_view rule, std::string_view input, MutableTransducer* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  static const ::fst::StringCompiler<Arc> compiler(
+      ::fst::TokenType::BYTE);
+  MutableTransducer str_fst;
+  if (!compiler(input, &str_fst)) return false;
+  return Rewrite(rule, str_fst, output, pdt_parens_rule,
+                 mpdt_assignments_rule);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::Rewrite(
+    std::string_view rule, const Transducer& input, MutableTransducer* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  // The pin keeps the generation holding the bound rules alive for the call,
+  // even if another one is published meanwhile.
+  auto* context = ThreadLocalContext();
+  const ContextPin pin(*this, context);
+  const auto* bound =
+      context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  return bound && Record(rule, context, output, [&] {
+           return Rewrite(*bound, input, context, output);
+         });
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::Rewrite(const BoundRule& rule,
+                                      const Transducer& input,
+                                      RewriteContext* context,
+                                      ::fst::MutableFst<Arc>* output,
+                                      bool connect) {
+  if (rule.pdt_metadata) {
+    const auto& pdt_parens = rule.pdt_metadata->parens;
+    // PdtComposeFilter::EXPAND removes the parentheses, allowing for subsequent
+    // application of PDTs. At the end (in StringifyFst() we use ordinary
+    // ShortestPath().
+    if (rule.mpdt) {
+      const ::fst::MPdtComposeOptions opts(connect,
+                                           ::fst::PdtComposeFilter::EXPAND);
+      ::fst::Compose(input, *rule.fst, pdt_parens,
+                         rule.pdt_metadata->assignments, output, opts);
+    } else {
+      const ::fst::PdtComposeOptions opts(connect,
+                                          ::fst::PdtComposeFilter::EXPAND);
+      ::fst::Compose(input, *rule.fst, pdt_parens, output, opts);
+    }
+  } else if (rule.lookahead) {
+    // Relabels the input's output labels to match the rule's input labels.
+    const auto& lookahead = *rule.lookahead;
+    auto& relabeled = context->lookahead_input_;
+    relabeled.DeleteStates();
+    for (::fst::StateIterator<Transducer> siter(input); !siter.Done();
+         siter.Next()) {
+      const auto state = siter.Value();
+      while (relabeled.NumStates() <= state) relabeled.AddState();
+      relabeled.SetFinal(state, input.Final(state));
+      for (::fst::ArcIterator<Transducer> aiter(input, state); !aiter.Done();
+           aiter.Next()) {
+        auto arc = aiter.Value();
+        arc.olabel = lookahead.Relabel(arc.olabel);
+        relabeled.AddArc(state, arc);
+      }
+    }
+    relabeled.SetStart(input.Start());
+    // Relabeling does not preserve the order of the arcs leaving each state,
+    // which the lookahead filter's matcher on the input needs.
+    ::fst::ArcSort(&relabeled, ::fst::OLabelCompare<Arc>());
+    using LookAhead = ::fst::DefaultLookAhead<Arc, ::fst::MATCH_INPUT>;
+    if (!ExpandCompose<typename LookAhead::FstMatcher,
+                       typename LookAhead::ComposeFilter>(
+            relabeled, *lookahead.fst, output)) {
+      return false;
+    }
+    output->SetInputSymbols(input.InputSymbols());
+    output->SetOutputSymbols(rule.fst->OutputSymbols());
+    if (connect) ::fst::Connect(output);
+  } else {
+    using Matcher = ::fst::Matcher<Transducer>;
+    Matcher* matcher2 = nullptr;
+    if (rule.byte_tables) {
+      // The rule outlives the composition, so the matcher need not copy it.
+      matcher2 = new Matcher(new ::fst::ByteTableMatcher<Transducer>(
+          rule.fst, rule.byte_tables));
+    }
+    if (!ExpandCompose<Matcher, ::fst::AltSequenceComposeFilter<Matcher>>(
+            input, *rule.fst, output, matcher2)) {
+      return false;
+    }
+    if (connect) ::fst::Connect(output);
+  }
+  if (auto* stats = context->recording_) {
+    ++stats->compositions;
+    const auto num_states = output->NumStates();
+    stats->lattice_states += num_states;
+    for (typename Arc::StateId state = 0; state < num_states; ++state) {
+      stats->lattice_arcs += output->NumArcs(state);
+    }
+  }
+  return true;
+}
+
+template <typename Arc>
+template <typename Output, typename Rewriter>
+bool AbstractGrmManager<Arc>::Record(std::string_view name,
+                                     RewriteContext* context,
+                                     const Output* output,
+                                     Rewriter rewrite) const {
+  // Nested calls are recorded as part of the outer one.
+  if (!rule_stats_ || context->recording_) return rewrite();
+  RuleStats sample;
+  context->recording_ = &sample;
+  const auto start = std::chrono::steady_clock::now();
+  const bool success = rewrite();
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  context->recording_ = nullptr;
+  sample.calls = 1;
+  if (!success) {
+    sample.failures = 1;
+  } else if constexpr (std::is_base_of_v<::fst::Fst<Arc>, Output>) {
+    sample.output_size = output->NumStates();
+  } else {
+    sample.output_size = output->size();
+  }
+  sample.AddLatency(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  rule_stats_->Add(name, sample);
+  return success;
+}
 
- private:
-  AbstractGrmManager(const AbstractGrmManager&) = delete;
-  AbstractGrmManager& operator=(const AbstractGrmManager&) = delete;
-};
+template <typename Arc>
+template <typename Matcher, typename Filter>
+bool AbstractGrmManager<Arc>::ExpandCompose(const Transducer& fst1,
+                                            const Transducer& fst2,
+                                            ::fst::MutableFst<Arc>* output,
+                                            Matcher* matcher2) {
+  // Expands the composition straight into the output; Compose() would instead
+  // replace the output's storage, which may be pooled.
+  ::fst::ComposeFstOptions<Arc, Matcher, Filter> opts;
+  opts.gc_limit = 0;
+  opts.matcher2 = matcher2;
+  const ::fst::ComposeFst<Arc> compose(fst1, fst2, opts);
+  if (!::fst::BoundedExpand(compose, output)) {
+    LOG(ERROR) << "Composition failed";
+    return false;
+  }
+  output->SetInputSymbols(compose.InputSymbols());
+  output->SetOutputSymbols(compose.OutputSymbols());
+  return true;
+}
 
 template <typename Arc>
-AbstractGrmManager<Arc>::AbstractGrmManager() {}
+bool AbstractGrmManager<Arc>::RewriteNBest(
+    std::string_view rule, std::string_view input, size_t n,
+    std::vector<std::string>* outputs,
+    std::vector<typename Arc::Weight>* weights,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  outputs->clear();
+  if (weights) weights->clear();
+  auto* context = ThreadLocalContext();
+  const ContextPin pin(*this, context);
+  const auto* bound =
+      context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  if (!bound) return false;
+  return Record(rule, context, outputs, [&] {
+    if (bound->alphabet && !bound->alphabet->ContainsBytes(input)) {
+      return false;
+    }
+    context->CompileBytes(input);
+    // Dead ends are skipped by the search, so the lattice need not be
+    // trimmed.
+    if (!Rewrite(*bound, context->input_, context, &context->lattice_,
+                 /*connect=*/false)) {
+      return false;
+    }
+    return ::fst::NBestStrings(context->lattice_, n, outputs, weights);
+  });
+}
 
 template <typename Arc>
-AbstractGrmManager<Arc>::~AbstractGrmManager() {
+bool AbstractGrmManager<Arc>::Accepts(
+    std::string_view rule, std::string_view input,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  auto* context = ThreadLocalContext();
+  const ContextPin pin(*this, context);
+  const auto* bound =
+      context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  if (!bound) return false;
+  if (bound->alphabet && !bound->alphabet->ContainsBytes(input)) return false;
+  // The domain of a PDT need not be regular.
+  if (!bound->pdt_metadata) {
+    // Built from the context's binding of the rule, which the building thread
+    // may read on its own, outside the generation's lock.
+    const auto* domain = context->template GetDerived<DomainAcceptor>(
+        DomainKey(rule), [&] {
+          auto domain =
+              DomainAcceptor::Make(*bound->fst, opts_.max_domain_states);
+          if (!domain) {
+            VLOG(1) << "The input acceptor of rule " << rule
+                    << " exceeds the budget";
+          }
+          return domain;
+        });
+    if (domain) return domain->AcceptsBytes(input);
+  }
+  std::string output;
+  return CachedRewriteBytes(*bound, input, context, &output);
 }
 
 template <typename Arc>
-template <typename FarReader>
-bool AbstractGrmManager<Arc>::LoadArchive(FarReader* reader,
-                                          std::string_view filename) {
-  fsts_.clear();
-  for (reader->Reset(); !reader->Done(); reader->Next()) {
-    const auto& name = reader->GetKey();
-    fsts_[name] = std::make_unique<MutableTransducer>(*reader->GetFst());
+bool AbstractGrmManager<Arc>::RewriteFirst(
+    const std::vector<std::string>& rules, std::string_view input,
+    std::string* output, size_t* index) const {
+  auto* context = ThreadLocalContext();
+  const ContextPin pin(*this, context);
+  // Rule names cannot contain NULs, so the key is unambiguous.
+  std::string key = "dispatch:";
+  for (const auto& rule : rules) {
+    key.append(rule);
+    key.push_back('\0');
   }
-  if (fsts_.size() == 0) {
-    LOG(ERROR) << filename << " is an empty FAR: Did you `export` any rules?";
-    return false;
+  // The acceptor is built from thread-safe copies of the rules, outside the
+  // generation's lock.
+  const auto* dispatch = context->template GetDerived<RuleDispatch>(key, [&] {
+    return MakeRuleDispatch(*context->generation_, rules,
+                            opts_.max_domain_states);
+  });
+  auto state = ::fst::kNoStateId;
+  if (dispatch) {
+    state = dispatch->acceptor->WalkBytes(input);
+    if (state == ::fst::kNoStateId) return false;
   }
-  SortRuleInputLabels();
-  return true;
+  for (size_t i = 0; i < rules.size(); ++i) {
+    if (dispatch && !dispatch->Accepts(state, i)) continue;
+    const auto* bound = context->Bind(rules[i], "", "");
+    if (!bound) continue;
+    if (Record(rules[i], context, output, [&] {
+          return CachedRewriteBytes(*bound, input, context, output);
+        })) {
+      if (index) *index = i;
+      return true;
+    }
+  }
+  return false;
 }
 
 template <typename Arc>
-void AbstractGrmManager<Arc>::LoadFstMap(FstMap named_fsts) {
-  for (const auto& key_and_fst : named_fsts) {
-    CHECK_NE(key_and_fst.second, nullptr);
+std::unique_ptr<typename AbstractGrmManager<Arc>::RuleDispatch>
+AbstractGrmManager<Arc>::MakeRuleDispatch(const Generation& generation,
+                                          const std::vector<std::string>& rules,
+                                          int64_t max_states) {
+  std::vector<MutableTransducer> sides;
+  sides.reserve(rules.size());
+  Label max_label = 0;
+  for (const auto& rule : rules) {
+    const auto fst = generation.GetFstSafe(rule);
+    if (!fst) return nullptr;
+    sides.emplace_back(*fst);
+    auto& side = sides.back();
+    ::fst::Project(&side, ::fst::ProjectType::INPUT);
+    for (::fst::StateIterator<MutableTransducer> siter(side); !siter.Done();
+         siter.Next()) {
+      for (::fst::ArcIterator<MutableTransducer> aiter(side, siter.Value());
+           !aiter.Done(); aiter.Next()) {
+        max_label = std::max(max_label, aiter.Value().ilabel);
+      }
+    }
   }
-  fsts_ = std::move(named_fsts);
-  SortRuleInputLabels();
+  auto dispatch = std::make_unique<RuleDispatch>();
+  dispatch->first_marker = max_label + 1;
+  MutableTransducer tagged;
+  for (size_t i = 0; i < sides.size(); ++i) {
+    const Label marker = dispatch->first_marker + i;
+    MutableTransducer tag;
+    tag.AddStates(2);
+    tag.SetStart(0);
+    tag.AddArc(0, Arc(marker, marker, Arc::Weight::One(), 1));
+    tag.SetFinal(1, Arc::Weight::One());
+    ::fst::Concat(&sides[i], tag);
+    if (i == 0) {
+      tagged = std::move(sides[i]);
+    } else {
+      ::fst::Union(&tagged, sides[i]);
+    }
+  }
+  dispatch->acceptor = DomainAcceptor::Make(tagged, max_states);
+  if (!dispatch->acceptor) {
+    VLOG(1) << "The input acceptor of the " << rules.size()
+            << " dispatched rules exceeds the budget";
+    return nullptr;
+  }
+  return dispatch;
 }
 
 template <typename Arc>
-void AbstractGrmManager<Arc>::SortRuleInputLabels() {
-  for (auto &pair : fsts_) {
-    const auto& fst = *pair.second;
-    // Arc-sorts if the FST is not known to be input-sorted.
-    if (fst.Properties(::fst::kILabelSorted, false) !=
-        ::fst::kILabelSorted) {
-      auto sorted_fst = std::make_unique<MutableTransducer>(fst);
-      static const ::fst::ILabelCompare<Arc> icomp;
-      ::fst::ArcSort(sorted_fst.get(), icomp);
-      pair.second = std::move(sorted_fst);
-    }
+std::unique_ptr<const typename AbstractGrmManager<Arc>::RuleHandle>
+AbstractGrmManager<Arc>::GetRuleHandle(
+    std::string_view rule, std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  auto handle = fst::WrapUnique(new RuleHandle());
+  handle->generation_ = GetGeneration();
+  if (!Bind(*handle->generation_, rule, pdt_parens_rule,
+            mpdt_assignments_rule, &handle->bound_)) {
+    return nullptr;
   }
+  handle->rule_ = std::string(rule);
+  handle->pdt_parens_rule_ = std::string(pdt_parens_rule);
+  handle->mpdt_assignments_rule_ = std::string(mpdt_assignments_rule);
+  return handle;
 }
 
 template <typename Arc>
-const typename AbstractGrmManager<Arc>::Transducer*
-AbstractGrmManager<Arc>::GetFst(std::string_view name) const {
-  const auto it = fsts_.find(name);
-  return it == fsts_.end() ? nullptr : it->second.get();
+const typename AbstractGrmManager<Arc>::BoundRule*
+AbstractGrmManager<Arc>::Bind(const RuleHandle& handle,
+                              RewriteContext* context) {
+  if (handle.bound_.thread_safe) return &handle.bound_;
+  return context->Bind(handle);
 }
 
 template <typename Arc>
-std::unique_ptr<typename AbstractGrmManager<Arc>::Transducer>
-AbstractGrmManager<Arc>::GetFstSafe(std::string_view name) const {
-  const auto* fst = GetFst(name);
-  return fst::WrapUnique(fst ? fst->Copy(true) : nullptr);
+bool AbstractGrmManager<Arc>::RewriteBytes(const RuleHandle& handle,
+                                           std::string_view input,
+                                           std::string* output,
+                                           RewriteContext* context) const {
+  if (!context) context = ThreadLocalContext();
+  const auto* bound = Bind(handle, context);
+  return bound && Record(bound->name, context, output, [&] {
+           return CachedRewriteBytes(*bound, input, context, output);
+         });
 }
 
 template <typename Arc>
-bool AbstractGrmManager<Arc>::SetFst(std::string_view name,
-                                     const Transducer& input) {
-  auto it = fsts_.find(name);
-  if (it != fsts_.end()) {
-    it->second = fst::WrapUnique(input.Copy(true));
-    return true;
+bool AbstractGrmManager<Arc>::RewriteBytes(const RuleHandle& handle,
+                                           const Transducer& input,
+                                           std::string* output,
+                                           RewriteContext* context) const {
+  if (!context) context = ThreadLocalContext();
+  const auto* bound = Bind(handle, context);
+  return bound && Record(bound->name, context, output, [&] {
+           return RewriteBytes(*bound, input, context, output);
+         });
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteLabels(
+    std::string_view rule, const std::vector<Label>& input,
+    std::vector<Label>* output, std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  return RewriteLabelRange(rule, input.begin(), input.end(), output,
+                           pdt_parens_rule, mpdt_assignments_rule);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteCodepoints(
+    std::string_view rule, std::u32string_view input, std::u32string* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  return RewriteLabelRange(rule, input.begin(), input.end(), output,
+                           pdt_parens_rule, mpdt_assignments_rule);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteCodepoints(
+    std::string_view rule, std::u32string_view input, std::string* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  return RewriteLabelsToUtf8(rule, input.begin(), input.end(), output,
+                             pdt_parens_rule, mpdt_assignments_rule);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::RewriteString(
+    std::string_view rule, std::string_view input,
+    ::fst::TokenType token_type, std::string* output,
+    std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  switch (token_type) {
+    case ::fst::TokenType::BYTE:
+      return RewriteBytes(rule, input, output, pdt_parens_rule,
+                          mpdt_assignments_rule);
+    case ::fst::TokenType::UTF8: {
+      auto& labels = ThreadLocalContext()->labels_;
+      labels.clear();
+      if (!::fst::UTF8StringToLabels(input, &labels)) {
+        LOG(ERROR) << "Input is not valid UTF-8: " << input;
+        return false;
+      }
+      return RewriteLabelsToUtf8(rule, labels.cbegin(), labels.cend(),
+                                 output, pdt_parens_rule,
+                                 mpdt_assignments_rule);
+    }
+    default:
+      LOG(ERROR) << "RewriteString: Unsupported token type";
+      return false;
   }
-  return false;
 }
 
 template <typename Arc>
-bool AbstractGrmManager<Arc>::RewriteBytes(
-    std::string_view rule, std::string_view input, std::string* output,
+template <typename Iterator, typename Container>
+bool AbstractGrmManager<Arc>::RewriteLabelRange(
+    std::string_view rule, Iterator begin, Iterator end, Container* output,
     std::string_view pdt_parens_rule,
     std::string_view mpdt_assignments_rule) const {
-  static const ::fst::StringCompiler<Arc> compiler(
-      ::fst::TokenType::BYTE);
-  MutableTransducer str_fst;
-  if (!compiler(input, &str_fst)) return false;
-  return RewriteBytes(rule, str_fst, output, pdt_parens_rule,
-                      mpdt_assignments_rule);
+  output->resize(0);
+  auto* context = ThreadLocalContext();
+  const ContextPin pin(*this, context);
+  const auto* bound =
+      context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  return bound && Record(rule, context, output, [&] {
+           return RewriteLabels(*bound, begin, end, context, output);
+         });
 }
 
 template <typename Arc>
-bool AbstractGrmManager<Arc>::RewriteBytes(
-    std::string_view rule, const Transducer& input, std::string* output,
+template <typename Iterator>
+bool AbstractGrmManager<Arc>::RewriteLabelsToUtf8(
+    std::string_view rule, Iterator begin, Iterator end, std::string* output,
     std::string_view pdt_parens_rule,
     std::string_view mpdt_assignments_rule) const {
-  MutableTransducer output_fst;
-  if (!Rewrite(rule, input, &output_fst, pdt_parens_rule,
-               mpdt_assignments_rule)) {
+  Utf8Appender appender(output);
+  if (!RewriteLabelRange(rule, begin, end, &appender, pdt_parens_rule,
+                         mpdt_assignments_rule)) {
     return false;
   }
-  StringifyFst(&output_fst);
-  if (output_fst.Start() == ::fst::kNoStateId) return false;
-  static const ::fst::StringPrinter<Arc> printer(
-      ::fst::TokenType::BYTE);
-  return printer(output_fst, output);
+  if (appender.Error()) {
+    LOG(ERROR) << "Rule " << rule << " output a label which is not a "
+               << "Unicode codepoint";
+    output->clear();
+    return false;
+  }
+  return true;
 }
 
 template <typename Arc>
-bool AbstractGrmManager<Arc>::Rewrite(
-    std::string_view rule, std::string_view input, MutableTransducer* output,
+template <typename Iterator, typename Container>
+bool AbstractGrmManager<Arc>::RewriteLabels(const BoundRule& rule,
+                                            Iterator begin, Iterator end,
+                                            RewriteContext* context,
+                                            Container* output) {
+  if (rule.alphabet && !rule.alphabet->ContainsAll(begin, end)) return false;
+  if (rule.sequential) {
+    return ::fst::SequentialApply(*rule.fst, begin, end, output);
+  }
+  context->CompileLabels(begin, end);
+  // The lattice is not trimmed, as the best path does not depend on it.
+  if (!Rewrite(rule, context->input_, context, &context->lattice_,
+               /*connect=*/false)) {
+    return false;
+  }
+  return context->AppendShortestPath(context->lattice_, output);
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::Utf8Appender::push_back(Label label) {
+  if (label < 0 || label > 0x10FFFF || (label >= 0xD800 && label < 0xE000)) {
+    error_ = true;
+  } else if (label < 0x80) {
+    output_->push_back(static_cast<char>(label));
+  } else if (label < 0x800) {
+    output_->push_back(static_cast<char>(0xC0 | (label >> 6)));
+    output_->push_back(static_cast<char>(0x80 | (label & 0x3F)));
+  } else if (label < 0x10000) {
+    output_->push_back(static_cast<char>(0xE0 | (label >> 12)));
+    output_->push_back(static_cast<char>(0x80 | ((label >> 6) & 0x3F)));
+    output_->push_back(static_cast<char>(0x80 | (label & 0x3F)));
+  } else {
+    output_->push_back(static_cast<char>(0xF0 | (label >> 18)));
+    output_->push_back(static_cast<char>(0x80 | ((label >> 12) & 0x3F)));
+    output_->push_back(static_cast<char>(0x80 | ((label >> 6) & 0x3F)));
+    output_->push_back(static_cast<char>(0x80 | (label & 0x3F)));
+  }
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::Rewrite(const RuleHandle& handle,
+                                      const Transducer& input,
+                                      MutableTransducer* output) const {
+  auto* context = ThreadLocalContext();
+  const auto* bound = Bind(handle, context);
+  return bound && Record(bound->name, context, output, [&] {
+           return Rewrite(*bound, input, context, output);
+         });
+}
+
+template <typename Arc>
+std::unique_ptr<typename AbstractGrmManager<Arc>::StreamRewriter>
+AbstractGrmManager<Arc>::MakeStreamRewriter(
+    std::string_view rule, const StreamRewriteOptions& opts,
+    std::function<bool(std::string_view)> emit,
     std::string_view pdt_parens_rule,
     std::string_view mpdt_assignments_rule) const {
-  static const ::fst::StringCompiler<Arc> compiler(
-      ::fst::TokenType::BYTE);
-  MutableTransducer str_fst;
-  if (!compiler(input, &str_fst)) return false;
-  return Rewrite(rule, str_fst, output, pdt_parens_rule,
-                 mpdt_assignments_rule);
+  auto rewriter =
+      fst::WrapUnique(new StreamRewriter(*this, opts, std::move(emit)));
+  auto& context = rewriter->context_;
+  context.Pin(*this);
+  rewriter->rule_ = context.Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+  rewriter->boundary_ = context.Bind(opts.boundary_rule, "", "");
+  if (!rewriter->rule_ || !rewriter->boundary_) return nullptr;
+  return rewriter;
 }
 
 template <typename Arc>
-bool AbstractGrmManager<Arc>::Rewrite(
-    std::string_view rule, const Transducer& input, MutableTransducer* output,
+bool AbstractGrmManager<Arc>::RewriteStream(
+    std::string_view rule, std::istream* input,
+    const StreamRewriteOptions& opts,
+    std::function<bool(std::string_view)> emit,
     std::string_view pdt_parens_rule,
     std::string_view mpdt_assignments_rule) const {
-  const std::unique_ptr<const Transducer> rule_fst = GetFstSafe(rule);
-  if (!rule_fst) {
-    LOG(ERROR) << "Rule " << rule << " not found.";
+  static constexpr size_t kReadBytes = 1 << 16;
+  auto rewriter = MakeStreamRewriter(rule, opts, std::move(emit),
+                                     pdt_parens_rule, mpdt_assignments_rule);
+  if (!rewriter) return false;
+  std::string chunk(kReadBytes, '\0');
+  while (input->read(&chunk[0], chunk.size()) || input->gcount() > 0) {
+    if (!rewriter->Feed(std::string_view(chunk.data(), input->gcount()))) {
+      return false;
+    }
+  }
+  if (input->bad()) {
+    LOG(ERROR) << "Error reading the input stream";
     return false;
   }
-  std::unique_ptr<const Transducer> pdt_parens_fst;
-  if (!pdt_parens_rule.empty()) {
-    pdt_parens_fst = GetFstSafe(pdt_parens_rule);
-    if (!pdt_parens_fst) {
-      LOG(ERROR) << "PDT parentheses rule " << pdt_parens_rule << " not found.";
+  return rewriter->Finish();
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::StreamRewriter::Feed(std::string_view chunk) {
+  if (failed_) return false;
+  buffer_.append(chunk);
+  return Process(/*finish=*/false);
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::StreamRewriter::Finish() {
+  if (failed_ || !Process(/*finish=*/true)) return false;
+  return buffer_.empty() || Emit(buffer_.size());
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::StreamRewriter::Process(bool finish) {
+  const auto max_bytes = opts_.max_segment_bytes;
+  while (true) {
+    // Every start position before that of the earliest thread is decided.
+    const auto undecided =
+        threads_.empty() ? match_pos_ : threads_.front().second;
+    if (matched_ && undecided > match_start_) {
+      if (!SkipTo(match_start_) || !PassBoundary(match_end_)) return false;
+      continue;
+    }
+    if (!SkipTo(matched_ ? std::min(undecided, match_start_) : undecided)) {
       return false;
     }
+    if (match_pos_ < buffer_.size()) {
+      Step();
+    } else if (threads_.empty()) {
+      break;
+    } else if (finish) {
+      // No boundary can continue past the end of the input.
+      threads_.clear();
+    } else if (max_bytes > 0 && buffer_.size() > max_bytes) {
+      // The earliest start position still being matched is decided on the
+      // input seen so far, so that the buffer stays bounded.
+      const auto start = threads_.front().second;
+      threads_.erase(
+          std::remove_if(threads_.begin(), threads_.end(),
+                         [start](const std::pair<StateId, size_t>& thread) {
+                           return thread.second == start;
+                         }),
+          threads_.end());
+    } else {
+      break;
+    }
   }
-  std::unique_ptr<const Transducer> mpdt_assignments_fst;
-  if (!mpdt_assignments_rule.empty()) {
-    mpdt_assignments_fst = GetFstSafe(mpdt_assignments_rule);
-    if (!mpdt_assignments_fst) {
-      LOG(ERROR) << "MPDT assignments rule " << mpdt_assignments_rule
-                 << " not found.";
-      return false;
+  return true;
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::StreamRewriter::Step() {
+  const auto& fst = *boundary_->fst;
+  // Once a boundary has been found, later start positions would fall within
+  // it, or be rescanned after it.
+  if (!matched_ && fst.Start() != ::fst::kNoStateId) {
+    AddThread(fst.Start(), match_pos_, &threads_);
+  }
+  const Label byte = static_cast<unsigned char>(buffer_[match_pos_]);
+  next_threads_.clear();
+  for (const auto& [state, start] : threads_) {
+    for (::fst::ArcIterator<Transducer> aiter(fst, state); !aiter.Done();
+         aiter.Next()) {
+      const auto& arc = aiter.Value();
+      if (arc.ilabel == byte) AddThread(arc.nextstate, start, &next_threads_);
     }
   }
-  if (pdt_parens_fst) {
-    MutableTransducer mut_pdt_parens_fst(*pdt_parens_fst);
-    std::vector<std::pair<Label, Label>> pdt_parens;
-    MakeParensPairVector(mut_pdt_parens_fst, &pdt_parens);
-    // PdtComposeFilter::EXPAND removes the parentheses, allowing for subsequent
-    // application of PDTs. At the end (in StringifyFst() we use ordinary
-    // ShortestPath().
-    if (mpdt_assignments_fst) {
-      MutableTransducer mut_mpdt_assignments_fst(*mpdt_assignments_fst);
-      std::vector<Label> mpdt_assignments;
-      MakeAssignmentsVector(mut_mpdt_assignments_fst, pdt_parens,
-                            &mpdt_assignments);
-      static const ::fst::MPdtComposeOptions opts(
-          true, ::fst::PdtComposeFilter::EXPAND);
-      ::fst::Compose(input, *rule_fst, pdt_parens, mpdt_assignments, output,
-                         opts);
+  threads_.swap(next_threads_);
+  ++match_pos_;
+  for (const auto& [state, start] : threads_) {
+    if (fst.Final(state) == Arc::Weight::Zero()) continue;
+    if (!matched_ || start < match_start_) {
+      matched_ = true;
+      match_start_ = start;
+      match_end_ = match_pos_;
+    } else if (start == match_start_) {
+      match_end_ = match_pos_;
+    }
+  }
+  if (matched_) {
+    threads_.erase(
+        std::remove_if(threads_.begin(), threads_.end(),
+                       [this](const std::pair<StateId, size_t>& thread) {
+                         return thread.second > match_start_;
+                       }),
+        threads_.end());
+  }
+}
+
+template <typename Arc>
+void AbstractGrmManager<Arc>::StreamRewriter::AddThread(
+    StateId state, size_t start,
+    std::vector<std::pair<StateId, size_t>>* threads) const {
+  const auto has_state = [threads](StateId target) {
+    return std::find_if(threads->begin(), threads->end(),
+                        [target](const std::pair<StateId, size_t>& thread) {
+                          return thread.first == target;
+                        }) != threads->end();
+  };
+  if (has_state(state)) return;
+  const auto& fst = *boundary_->fst;
+  threads->emplace_back(state, start);
+  for (auto i = threads->size() - 1; i < threads->size(); ++i) {
+    for (::fst::ArcIterator<Transducer> aiter(fst, (*threads)[i].first);
+         !aiter.Done(); aiter.Next()) {
+      const auto& arc = aiter.Value();
+      if (arc.ilabel == 0 && !has_state(arc.nextstate)) {
+        threads->emplace_back(arc.nextstate, start);
+      }
+    }
+  }
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::StreamRewriter::SkipTo(size_t pos) {
+  const auto max_bytes = opts_.max_segment_bytes;
+  // Emitting shifts the buffer, so the bytes are counted rather than the
+  // position compared.
+  for (auto remaining = pos - scan_; remaining > 0; --remaining) {
+    ++scan_;
+    if (max_bytes == 0 || scan_ < max_bytes) continue;
+    if (last_boundary_ > 0) {
+      if (!Emit(last_boundary_)) return false;
     } else {
-      static const ::fst::PdtComposeOptions opts(
-          true, ::fst::PdtComposeFilter::EXPAND);
-      ::fst::Compose(input, *rule_fst, pdt_parens, output, opts);
+      VLOG(1) << "No boundary in " << max_bytes << " bytes of input; "
+              << "cutting the segment there";
+      if (!Emit(scan_)) return false;
     }
-  } else {
-    static const ::fst::ComposeOptions opts(true,
-                                                ::fst::ALT_SEQUENCE_FILTER);
-    ::fst::Compose(input, *rule_fst, output, opts);
   }
   return true;
 }
 
+template <typename Arc>
+bool AbstractGrmManager<Arc>::StreamRewriter::PassBoundary(size_t pos) {
+  const auto max_bytes = opts_.max_segment_bytes;
+  // Start positions after the boundary are matched anew.
+  threads_.clear();
+  matched_ = false;
+  match_pos_ = pos;
+  scan_ = pos;
+  if (max_bytes > 0 && scan_ > max_bytes && last_boundary_ > 0) {
+    // The new segment does not fit with those before it.
+    if (!Emit(last_boundary_)) return false;
+  }
+  last_boundary_ = scan_;
+  if (max_bytes == 0 || scan_ >= max_bytes) {
+    if (!Emit(last_boundary_)) return false;
+  }
+  return true;
+}
+
+template <typename Arc>
+bool AbstractGrmManager<Arc>::StreamRewriter::Emit(size_t size) {
+  const std::string_view segment(buffer_.data(), size);
+  if (!grm_.Record(rule_->name, &context_, &output_, [&] {
+        return grm_.CachedRewriteBytes(*rule_, segment, &context_, &output_);
+      })) {
+    if (!opts_.copy_failed_segments) {
+      failed_ = true;
+      return false;
+    }
+    ++num_failed_segments_;
+    output_.assign(segment);
+  }
+  if (!emit_(output_)) {
+    failed_ = true;
+    return false;
+  }
+  buffer_.erase(0, size);
+  scan_ -= size;
+  last_boundary_ = last_boundary_ > size ? last_boundary_ - size : 0;
+  // The matcher is never behind the scan.
+  match_pos_ -= size;
+  for (auto& thread : threads_) thread.second -= size;
+  if (matched_) {
+    match_start_ -= size;
+    match_end_ -= size;
+  }
+  return true;
+}
+
+template <typename Arc>
+size_t AbstractGrmManager<Arc>::RewriteBatch(
+    std::string_view rule, const std::vector<std::string_view>& inputs,
+    std::vector<std::string>* outputs, std::vector<bool>* succeeded,
+    ThreadPool* pool, std::string_view pdt_parens_rule,
+    std::string_view mpdt_assignments_rule) const {
+  const auto generation = GetGeneration();
+  // Checks the rules once up front so that a missing rule is only reported
+  // once, rather than by every worker.
+  BoundRule bound;
+  if (!Bind(*generation, rule, pdt_parens_rule, mpdt_assignments_rule,
+            &bound)) {
+    return RunBatch(inputs, outputs, succeeded, nullptr, [] {
+      return [](std::string_view, std::string*) { return false; };
+    });
+  }
+  // Workers use their thread's context, so that the rules bound and the
+  // scratch space allocated for one batch are reused by the next.
+  return RunBatch(inputs, outputs, succeeded, pool, [&] {
+    auto* context = ThreadLocalContext();
+    auto pin = std::make_unique<ContextPin>(*this, generation, context);
+    const auto* bound =
+        context->Bind(rule, pdt_parens_rule, mpdt_assignments_rule);
+    return [this, bound, context, pin = std::move(pin)](
+               std::string_view input, std::string* output) {
+      return Record(bound->name, context, output, [&] {
+        return CachedRewriteBytes(*bound, input, context, output);
+      });
+    };
+  });
+}
+
+template <typename Arc>
+template <typename MakeRewriter>
+size_t AbstractGrmManager<Arc>::RunBatch(
+    const std::vector<std::string_view>& inputs,
+    std::vector<std::string>* outputs, std::vector<bool>* succeeded,
+    ThreadPool* pool, MakeRewriter make_rewriter) {
+  // Inputs are handed out in small chunks, so that the workers stay balanced
+  // when the cost of a rewrite varies from input to input.
+  static constexpr size_t kChunkSize = 16;
+  const auto size = inputs.size();
+  outputs->clear();
+  outputs->resize(size);
+  // std::vector<bool> packs its elements, so neighbouring ones cannot be
+  // written by different threads; results are collected bytewise instead.
+  std::vector<char> status(size, 0);
+  std::atomic<size_t> next(0);
+  const int num_workers =
+      pool ? std::min<size_t>(pool->NumThreads(),
+                              (size + kChunkSize - 1) / kChunkSize)
+           : 1;
+  RunWorkers(pool, num_workers, [&] {
+    auto rewriter = make_rewriter();
+    for (auto begin = next.fetch_add(kChunkSize); begin < size;
+         begin = next.fetch_add(kChunkSize)) {
+      const auto end = std::min(begin + kChunkSize, size);
+      for (auto i = begin; i < end; ++i) {
+        auto& output = (*outputs)[i];
+        status[i] = rewriter(inputs[i], &output);
+        if (!status[i]) output.clear();
+      }
+    }
+  });
+  if (succeeded) succeeded->assign(status.begin(), status.end());
+  return std::count(status.begin(), status.end(), 1);
+}
 
 template <typename Arc>
 void AbstractGrmManager<Arc>::StringifyFst(MutableTransducer* fst) {
@@ -351,6 +2821,36 @@ struct RuleTriple {
   }
 };
 
+// Options controlling how a RuleCascade applies its rules.
+struct RuleCascadeOptions {
+  // Composes runs of adjacent non-PDT rules ahead of time, so that rewrites
+  // apply one precomposed FST per run rather than one FST per rule. This is
+  // done once per generation of rules, on first use, composing as rewrites
+  // do. As the lattices between the rules of a run are never built, they
+  // cannot be pruned, so this is ignored if any of the pruning below is
+  // enabled.
+  bool precompose = false;
+  // Also precomposes the current generation's rules during initialization.
+  bool precompose_at_init = false;
+  // Optimizes the precomposed FSTs.
+  bool optimize = false;
+  // Bounds the size of a precomposed FST. A rule whose composition with the
+  // run before it would exceed either bound starts a new run instead.
+  int64_t max_precomposed_states = 100000;
+  int64_t max_precomposed_arcs = 1000000;
+  // Pruning applied to the lattice between stages, so that an ambiguous stage
+  // does not inflate the work of the following ones. A negative value disables
+  // the corresponding pruning. Pruning applies to weights with the path
+  // property which can be constructed from a float, such as tropical weights.
+  //
+  // Removes paths whose weight exceeds that of the best path by the beam.
+  float beam = -1;
+  // Keeps at most this many states, removing those on the worst paths first.
+  int64_t max_lattice_states = -1;
+  // Keeps only this many best paths; zero is treated as disabled too.
+  int32_t max_paths = -1;
+};
+
 // Does not own the grm pointer.
 template <typename Arc>
 class RuleCascade {
@@ -360,6 +2860,9 @@ class RuleCascade {
  public:
   RuleCascade() : grm_(nullptr) {}
 
+  explicit RuleCascade(const RuleCascadeOptions& opts)
+      : grm_(nullptr), opts_(opts) {}
+
   // Initializes the cascade from rule triples.
   bool Init(const AbstractGrmManager<Arc>* grm,
             std::vector<RuleTriple> rule_triples);
@@ -376,11 +2879,77 @@ class RuleCascade {
 
   bool Rewrite(const Transducer& input, MutableTransducer* output) const;
 
+  // Rewrites a batch of inputs through the cascade; see
+  // AbstractGrmManager::RewriteBatch().
+  size_t RewriteBatch(const std::vector<std::string_view>& inputs,
+                      std::vector<std::string>* outputs,
+                      std::vector<bool>* succeeded = nullptr,
+                      ThreadPool* pool = nullptr) const;
+
  private:
+  using BoundRule = typename AbstractGrmManager<Arc>::BoundRule;
+  using ByteTables = typename AbstractGrmManager<Arc>::ByteTables;
+  using InputAlphabet = typename AbstractGrmManager<Arc>::InputAlphabet;
+
+  // The stages of a cascade with runs of rules precomposed.
+  struct Plan {
+    std::vector<BoundRule> stages;
+  };
+
   // Validates all rules.
   bool ValidateRules();
+
+  // Sets up precomposition, if requested.
+  void InitPlan();
+
+  // Builds the plan for the generation; returns nullptr if a rule is missing.
+  std::unique_ptr<Plan> MakePlan(
+      const typename AbstractGrmManager<Arc>::Generation& generation) const;
+
+  // Composes the FSTs into the output within the size budget, returning false
+  // if the budget is exceeded.
+  bool Precompose(const Transducer& fst1, const Transducer& fst2,
+                  MutableTransducer* output) const;
+
+  using RewriteContext = typename AbstractGrmManager<Arc>::RewriteContext;
+  using ContextPin = typename AbstractGrmManager<Arc>::ContextPin;
+
+  // Looks up the rules of every stage in the context's pinned generation,
+  // using the precomposed ones if precomposition is enabled.
+  bool Bind(RewriteContext* context,
+            std::vector<const BoundRule*>* stages) const;
+
+  // Runs the stages over the input, replacing the output by the final lattice,
+  // which is trimmed if connect is true. Intermediate lattices alternate
+  // between two of the context's scratch FSTs rather than being copied. The
+  // output must not be the input.
+  bool Rewrite(const std::vector<const BoundRule*>& stages,
+               const Transducer& input, RewriteContext* context,
+               ::fst::MutableFst<Arc>* output, bool connect) const;
+
+  // Prunes an intermediate lattice as the options require. Returns true if the
+  // result was written to the scratch FST rather than left in place.
+  bool Prune(::fst::MutableFst<Arc>* lattice,
+             ::fst::MutableFst<Arc>* scratch) const;
+
+  bool RewriteBytes(const std::vector<const BoundRule*>& stages,
+                    std::string_view input, RewriteContext* context,
+                    std::string* output) const;
+
+  // As above, but consulting the manager's result cache, if any.
+  bool CachedRewriteBytes(const std::vector<const BoundRule*>& stages,
+                          std::string_view input, RewriteContext* context,
+                          std::string* output) const;
+
   const AbstractGrmManager<Arc>* grm_;
   std::vector<RuleTriple> rule_triples_;
+  RuleCascadeOptions opts_;
+  // Identifies the plan among the objects derived from a generation; empty if
+  // precomposition is disabled.
+  std::string plan_key_;
+  // The name under which the cascade's rewrites are recorded, if the manager
+  // collects rule statistics.
+  std::string stats_name_;
 };
 
 template <typename Arc>
@@ -409,7 +2978,9 @@ bool RuleCascade<Arc>::Init(const AbstractGrmManager<Arc>* grm,
                             std::vector<RuleTriple> rule_triples) {
   grm_ = grm;
   rule_triples_ = std::move(rule_triples);
-  return ValidateRules();
+  if (!ValidateRules()) return false;
+  InitPlan();
+  return true;
 }
 
 template <typename Arc>
@@ -417,35 +2988,212 @@ bool RuleCascade<Arc>::InitFromDefs(const AbstractGrmManager<Arc>* grm,
                                     const std::vector<std::string>& rules) {
   grm_ = grm;
   for (auto& rule : rules) rule_triples_.emplace_back(rule);
-  return ValidateRules();
+  if (!ValidateRules()) return false;
+  InitPlan();
+  return true;
+}
+
+template <typename Arc>
+void RuleCascade<Arc>::InitPlan() {
+  stats_name_ = "cascade:";
+  for (size_t i = 0; i < rule_triples_.size(); ++i) {
+    if (i > 0) stats_name_.push_back(',');
+    stats_name_.append(rule_triples_[i].main_rule);
+  }
+  plan_key_.clear();
+  if (!opts_.precompose) return;
+  if (opts_.beam >= 0 || opts_.max_lattice_states >= 0 ||
+      opts_.max_paths > 0) {
+    VLOG(1) << "Not precomposing " << stats_name_
+            << ", whose lattices are pruned between stages";
+    return;
+  }
+  // Cascades share the plans of identical cascades with identical options.
+  plan_key_ = "precompose:" + std::to_string(opts_.optimize) + ":" +
+              std::to_string(opts_.max_precomposed_states) + ":" +
+              std::to_string(opts_.max_precomposed_arcs) + ":" +
+              std::to_string(rule_triples_.size());
+  for (const auto& rule_triple : rule_triples_) {
+    for (const auto* name :
+         {&rule_triple.main_rule, &rule_triple.pdt_parens_rule,
+          &rule_triple.mpdt_assignments_rule}) {
+      plan_key_.push_back('\0');
+      plan_key_.append(*name);
+    }
+  }
+  if (opts_.precompose_at_init) {
+    const auto generation = grm_->GetGeneration();
+    generation->template GetDerived<Plan>(
+        plan_key_, [&] { return MakePlan(*generation); });
+  }
+}
+
+template <typename Arc>
+std::unique_ptr<typename RuleCascade<Arc>::Plan> RuleCascade<Arc>::MakePlan(
+    const typename AbstractGrmManager<Arc>::Generation& generation) const {
+  auto plan = std::make_unique<Plan>();
+  for (const auto& rule_triple : rule_triples_) {
+    BoundRule stage;
+    if (!AbstractGrmManager<Arc>::Bind(generation, rule_triple.main_rule,
+                                       rule_triple.pdt_parens_rule,
+                                       rule_triple.mpdt_assignments_rule,
+                                       &stage)) {
+      return nullptr;
+    }
+    if (!plan->stages.empty()) {
+      auto& last = plan->stages.back();
+      if (!last.pdt_metadata && !stage.pdt_metadata) {
+        auto composed = std::make_unique<MutableTransducer>();
+        if (Precompose(*last.fst, *stage.fst, composed.get())) {
+          std::unique_ptr<const Transducer> fst = std::move(composed);
+          AbstractGrmManager<Arc>::PrepareRule(&fst);
+          last.owned_fst = std::move(fst);
+          last.fst = last.owned_fst.get();
+          last.thread_safe = true;
+          last.lookahead = nullptr;
+          last.owned_byte_tables.reset();
+          if (grm_->opts_.byte_table_min_arcs > 0) {
+            last.owned_byte_tables = std::make_unique<ByteTables>(
+                *last.fst, grm_->opts_.byte_table_min_arcs);
+          }
+          last.byte_tables = last.owned_byte_tables.get();
+          last.owned_alphabet.reset();
+          if (grm_->opts_.input_alphabets) {
+            last.owned_alphabet = std::make_unique<InputAlphabet>(*last.fst);
+          }
+          last.alphabet = last.owned_alphabet.get();
+          last.sequential = ::fst::IsSequential(*last.fst);
+          continue;
+        }
+        VLOG(1) << "Composing rule " << rule_triple.main_rule
+                << " with the rules before it exceeds the budget";
+      }
+    }
+    plan->stages.push_back(std::move(stage));
+  }
+  // The plan is shared by all threads, so rules which cannot be read
+  // concurrently are expanded.
+  for (auto& stage : plan->stages) {
+    if (stage.thread_safe) continue;
+    stage.owned_fst = std::make_unique<MutableTransducer>(*stage.fst);
+    stage.fst = stage.owned_fst.get();
+    stage.thread_safe = true;
+  }
+  return plan;
+}
+
+template <typename Arc>
+bool RuleCascade<Arc>::Precompose(const Transducer& fst1,
+                                  const Transducer& fst2,
+                                  MutableTransducer* output) const {
+  // With the filter AbstractGrmManager::Rewrite() uses, so that the composed
+  // rules have the paths which applying them in turn would.
+  using Matcher = ::fst::Matcher<Transducer>;
+  ::fst::ComposeFstOptions<Arc, Matcher,
+                           ::fst::AltSequenceComposeFilter<Matcher>>
+      compose_opts;
+  compose_opts.gc_limit = 0;
+  const ::fst::ComposeFst<Arc> compose(fst1, fst2, compose_opts);
+  if (!::fst::BoundedExpand(compose, output, opts_.max_precomposed_states,
+                            opts_.max_precomposed_arcs)) {
+    return false;
+  }
+  ::fst::Connect(output);
+  if (opts_.optimize) ::fst::Optimize(output);
+  return true;
+}
+
+template <typename Arc>
+bool RuleCascade<Arc>::Bind(RewriteContext* context,
+                            std::vector<const BoundRule*>* stages) const {
+  stages->clear();
+  if (!plan_key_.empty()) {
+    const auto* plan = context->template GetDerived<Plan>(
+        plan_key_, [&] { return MakePlan(*context->generation_); });
+    if (plan) {
+      for (const auto& stage : plan->stages) stages->push_back(&stage);
+      return true;
+    }
+    // Falls through to report the missing rule.
+  }
+  for (const auto& rule_triple : rule_triples_) {
+    const auto* bound = context->Bind(rule_triple.main_rule,
+                                      rule_triple.pdt_parens_rule,
+                                      rule_triple.mpdt_assignments_rule);
+    if (!bound) return false;
+    stages->push_back(bound);
+  }
+  return true;
 }
 
 template <typename Arc>
 bool RuleCascade<Arc>::RewriteBytes(std::string_view input,
                                     std::string* output) const {
-  static const ::fst::StringCompiler<Arc> compiler(
-      ::fst::TokenType::BYTE);
-  MutableTransducer input_fst;
-  if (!compiler(input, &input_fst)) return false;
-  MutableTransducer output_fst;
-  if (!Rewrite(input_fst, &output_fst)) return false;
-  AbstractGrmManager<Arc>::StringifyFst(&output_fst);
-  if (output_fst.Start() == ::fst::kNoStateId) return false;
-  static const ::fst::StringPrinter<Arc> printer(
-      ::fst::TokenType::BYTE);
-  return printer(output_fst, output);
+  // All stages use the same generation of rules, even if a new one is
+  // published in the meantime.
+  auto* context = grm_->ThreadLocalContext();
+  const ContextPin pin(*grm_, context);
+  if (!Bind(context, &context->stages_)) return false;
+  return grm_->Record(stats_name_, context, output, [&] {
+    return CachedRewriteBytes(context->stages_, input, context, output);
+  });
+}
+
+template <typename Arc>
+bool RuleCascade<Arc>::CachedRewriteBytes(
+    const std::vector<const BoundRule*>& stages, std::string_view input,
+    RewriteContext* context, std::string* output) const {
+  // Only the first stage reads the input itself.
+  if (const auto* alphabet = stages.empty() ? nullptr : stages[0]->alphabet;
+      alphabet && !alphabet->ContainsBytes(input)) {
+    return false;
+  }
+  if (!grm_->cache_) return RewriteBytes(stages, input, context, output);
+  // The stage count keeps the key unambiguous.
+  auto& key = context->cache_key_;
+  key.clear();
+  AbstractGrmManager<Arc>::AppendGenerationKey(*context->generation_, &key);
+  key.push_back('c');
+  const uint32_t num_stages = rule_triples_.size();
+  key.append(reinterpret_cast<const char*>(&num_stages), sizeof(num_stages));
+  for (const auto& rule_triple : rule_triples_) {
+    for (const auto* name :
+         {&rule_triple.main_rule, &rule_triple.pdt_parens_rule,
+          &rule_triple.mpdt_assignments_rule}) {
+      key.append(*name);
+      key.push_back('\0');
+    }
+  }
+  return grm_->RewriteThroughCache(input, context, output, [&] {
+    return RewriteBytes(stages, input, context, output);
+  });
 }
 
 template <typename Arc>
 bool RuleCascade<Arc>::RewriteBytes(const Transducer& input,
                                     std::string* output) const {
-  MutableTransducer output_fst;
-  if (!Rewrite(input, &output_fst)) return false;
-  AbstractGrmManager<Arc>::StringifyFst(&output_fst);
-  if (output_fst.Start() == ::fst::kNoStateId) return false;
-  static const ::fst::StringPrinter<Arc> printer(
-      ::fst::TokenType::BYTE);
-  return printer(output_fst, output);
+  auto* context = grm_->ThreadLocalContext();
+  const ContextPin pin(*grm_, context);
+  if (!Bind(context, &context->stages_)) return false;
+  return grm_->Record(stats_name_, context, output, [&] {
+    if (!Rewrite(context->stages_, input, context, &context->lattice_,
+                 /*connect=*/false)) {
+      return false;
+    }
+    return context->PrintShortestPath(context->lattice_, output);
+  });
+}
+
+template <typename Arc>
+bool RuleCascade<Arc>::RewriteBytes(
+    const std::vector<const BoundRule*>& stages, std::string_view input,
+    RewriteContext* context, std::string* output) const {
+  context->CompileBytes(input);
+  if (!Rewrite(stages, context->input_, context, &context->lattice_,
+               /*connect=*/false)) {
+    return false;
+  }
+  return context->PrintShortestPath(context->lattice_, output);
 }
 
 template <typename Arc>
@@ -461,18 +3209,105 @@ bool RuleCascade<Arc>::Rewrite(std::string_view input,
 template <typename Arc>
 bool RuleCascade<Arc>::Rewrite(const Transducer& input,
                                MutableTransducer* output) const {
-  MutableTransducer tmp_input(input);
-  for (auto& rule_triple : rule_triples_) {
-    if (!grm_->Rewrite(rule_triple.main_rule, tmp_input, output,
-                       rule_triple.pdt_parens_rule,
-                       rule_triple.mpdt_assignments_rule)) {
+  // All stages use the same generation of rules, even if a new one is
+  // published in the meantime.
+  auto* context = grm_->ThreadLocalContext();
+  const ContextPin pin(*grm_, context);
+  if (!Bind(context, &context->stages_)) return false;
+  return grm_->Record(stats_name_, context, output, [&] {
+    if (&input == output) {
+      const MutableTransducer input_copy(input);
+      return Rewrite(context->stages_, input_copy, context, output,
+                     /*connect=*/true);
+    }
+    return Rewrite(context->stages_, input, context, output,
+                   /*connect=*/true);
+  });
+}
+
+template <typename Arc>
+bool RuleCascade<Arc>::Rewrite(const std::vector<const BoundRule*>& stages,
+                               const Transducer& input,
+                               RewriteContext* context,
+                               ::fst::MutableFst<Arc>* output,
+                               bool connect) const {
+  auto* lattices = context->stage_lattices_;
+  const Transducer* current = &input;
+  // Index of the scratch lattice holding the current one, if any.
+  int index = 1;
+  for (size_t i = 0; i < stages.size(); ++i) {
+    if (i + 1 == stages.size()) {
+      return AbstractGrmManager<Arc>::Rewrite(*stages[i], *current, context,
+                                              output, connect);
+    }
+    index = 1 - index;
+    // Intermediate lattices are trimmed, so that dead ends are not carried
+    // into the next composition.
+    if (!AbstractGrmManager<Arc>::Rewrite(*stages[i], *current, context,
+                                          &lattices[index])) {
       return false;
     }
-    tmp_input = *output;
+    if (Prune(&lattices[index], &lattices[1 - index])) index = 1 - index;
+    current = &lattices[index];
   }
   return true;
 }
 
+template <typename Arc>
+bool RuleCascade<Arc>::Prune(::fst::MutableFst<Arc>* lattice,
+                             ::fst::MutableFst<Arc>* scratch) const {
+  using Weight = typename Arc::Weight;
+  if constexpr ((Weight::Properties() & ::fst::kPath) != 0 &&
+                std::is_constructible_v<Weight, float>) {
+    if (opts_.beam >= 0 || opts_.max_lattice_states >= 0) {
+      ::fst::Prune(lattice,
+                   opts_.beam >= 0 ? Weight(opts_.beam) : Weight::Zero(),
+                   opts_.max_lattice_states >= 0 ? opts_.max_lattice_states
+                                                 : ::fst::kNoStateId);
+    }
+    if (opts_.max_paths > 0) {
+      ::fst::ShortestPath(*lattice, scratch, opts_.max_paths);
+      return true;
+    }
+  }
+  return false;
+}
+
+template <typename Arc>
+size_t RuleCascade<Arc>::RewriteBatch(
+    const std::vector<std::string_view>& inputs,
+    std::vector<std::string>* outputs, std::vector<bool>* succeeded,
+    ThreadPool* pool) const {
+  const auto generation = grm_->GetGeneration();
+  // Checks the rules once up front so that a missing rule is only reported
+  // once, rather than by every worker.
+  bool bound;
+  {
+    auto* context = grm_->ThreadLocalContext();
+    const ContextPin pin(*grm_, generation, context);
+    bound = Bind(context, &context->stages_);
+  }
+  if (!bound) {
+    return AbstractGrmManager<Arc>::RunBatch(
+        inputs, outputs, succeeded, nullptr, [] {
+          return [](std::string_view, std::string*) { return false; };
+        });
+  }
+  return AbstractGrmManager<Arc>::RunBatch(
+      inputs, outputs, succeeded, pool, [&] {
+        auto* context = grm_->ThreadLocalContext();
+        auto pin = std::make_unique<ContextPin>(*grm_, generation, context);
+        Bind(context, &context->stages_);
+        return [this, context, pin = std::move(pin)](std::string_view input,
+                                                     std::string* output) {
+          return grm_->Record(stats_name_, context, output, [&] {
+            return CachedRewriteBytes(context->stages_, input, context,
+                                      output);
+          });
+        };
+      });
+}
+
 }  // namespace thrax
 
 #endif  // NLP_GRM_LANGUAGE_ABSTRACT_GRM_MANAGER_H_
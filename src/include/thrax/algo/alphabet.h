@@ -0,0 +1,128 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_ALPHABET_H_
+#define FST_UTIL_OPERATORS_ALPHABET_H_
+
+// The input alphabet of an FST: the set of input labels on its successful
+// paths.
+//
+// A string containing a label outside the input alphabet cannot be composed
+// with the FST, so the composition can be skipped. Byte labels are held in a
+// bitset, and others as a sorted list of ranges, which stays short for the
+// codepoint blocks used by grammars.
+
+#include <algorithm>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+#include <fst/connect.h>
+#include <fst/dfs-visit.h>
+#include <fst/fst.h>
+#include <string_view>
+
+namespace fst {
+
+template <class Arc>
+class InputAlphabet {
+ public:
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+
+  static constexpr Label kNumBytes = 256;
+
+  // Collects the input labels of the arcs which lie on successful paths.
+  explicit InputAlphabet(const Fst<Arc> &fst);
+
+  // Epsilon is always contained, as it matches without consuming input.
+  bool Contains(Label label) const {
+    if (label >= 0 && label < kNumBytes) return bytes_[label];
+    const auto it = std::upper_bound(
+        ranges_.begin(), ranges_.end(), label,
+        [](Label value, const Range &range) { return value < range.first; });
+    return it != ranges_.begin() && label <= std::prev(it)->second;
+  }
+
+  // Returns true if every label in [begin, end) is contained.
+  template <class Iterator>
+  bool ContainsAll(Iterator begin, Iterator end) const {
+    for (; begin != end; ++begin) {
+      if (!Contains(*begin)) return false;
+    }
+    return true;
+  }
+
+  // Returns true if every byte of the string is contained.
+  bool ContainsBytes(std::string_view bytes) const {
+    for (const unsigned char c : bytes) {
+      if (!bytes_[c]) return false;
+    }
+    return true;
+  }
+
+  // Approximate memory used by the alphabet.
+  size_t SizeBytes() const {
+    return sizeof(*this) + ranges_.capacity() * sizeof(Range);
+  }
+
+ private:
+  // Inclusive bounds.
+  using Range = std::pair<Label, Label>;
+
+  std::bitset<kNumBytes> bytes_;
+  std::vector<Range> ranges_;
+};
+
+template <class Arc>
+InputAlphabet<Arc>::InputAlphabet(const Fst<Arc> &fst) {
+  bytes_.set(0);
+  std::vector<bool> access;
+  std::vector<bool> coaccess;
+  uint64_t props = 0;
+  SccVisitor<Arc> visitor(nullptr, &access, &coaccess, &props);
+  DfsVisit(fst, &visitor);
+  std::vector<Label> labels;
+  for (StateIterator<Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
+    const auto state = siter.Value();
+    if (!access[state] || !coaccess[state]) continue;
+    for (ArcIterator<Fst<Arc>> aiter(fst, state); !aiter.Done();
+         aiter.Next()) {
+      const auto &arc = aiter.Value();
+      if (!coaccess[arc.nextstate]) continue;
+      if (arc.ilabel >= 0 && arc.ilabel < kNumBytes) {
+        bytes_.set(arc.ilabel);
+      } else {
+        labels.push_back(arc.ilabel);
+      }
+    }
+  }
+  std::sort(labels.begin(), labels.end());
+  labels.erase(std::unique(labels.begin(), labels.end()), labels.end());
+  for (const auto label : labels) {
+    if (!ranges_.empty() && ranges_.back().second + 1 == label) {
+      ranges_.back().second = label;
+    } else {
+      ranges_.emplace_back(label, label);
+    }
+  }
+  ranges_.shrink_to_fit();
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_ALPHABET_H_
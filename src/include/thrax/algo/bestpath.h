@@ -0,0 +1,208 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_BESTPATH_H_
+#define FST_UTIL_OPERATORS_BESTPATH_H_
+
+// Extraction of the output labels of the best path through an FST.
+//
+// This computes the same path as ShortestPath() with n = 1, but reads the
+// output labels off the shortest-distance back-pointers rather than building
+// the path as an FST, which would then have to be projected and have its
+// epsilons removed before it could be printed. Acyclic FSTs are processed in
+// topological order, as ShortestPath() would via its automatic queue; others
+// are processed best-first.
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <fst/expanded-fst.h>
+#include <fst/fst.h>
+#include <fst/properties.h>
+#include <fst/weight.h>
+
+namespace fst {
+
+// Working storage for BestPath(), which may be reused across calls to avoid
+// reallocating it.
+template <class Arc>
+struct BestPathBuffers {
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+
+  std::vector<Weight> distance;
+  // For each state, the previous state and arc position on its best path.
+  std::vector<std::pair<StateId, size_t>> parent;
+  // Topological order, or the best-first heap for cyclic FSTs.
+  std::vector<StateId> order;
+  std::vector<std::pair<Weight, StateId>> heap;
+  // Depth-first search stack and state colors.
+  std::vector<std::pair<StateId, size_t>> stack;
+  std::vector<uint8_t> color;
+  std::vector<Label> labels;
+};
+
+namespace internal {
+
+// Computes a topological order of the states reachable from the start state,
+// as the reverse of the depth-first finishing order. Returns false if a cycle
+// is reachable.
+template <class Arc>
+bool TopOrder(const Fst<Arc> &fst, BestPathBuffers<Arc> *buffers) {
+  enum : uint8_t { kWhite = 0, kGrey = 1, kBlack = 2 };
+  auto &color = buffers->color;
+  auto &stack = buffers->stack;
+  auto &order = buffers->order;
+  order.clear();
+  stack.clear();
+  stack.emplace_back(fst.Start(), 0);
+  color[fst.Start()] = kGrey;
+  while (!stack.empty()) {
+    auto &[state, pos] = stack.back();
+    ArcIterator<Fst<Arc>> aiter(fst, state);
+    aiter.Seek(pos);
+    if (aiter.Done()) {
+      color[state] = kBlack;
+      order.push_back(state);
+      stack.pop_back();
+      continue;
+    }
+    ++pos;
+    const auto nextstate = aiter.Value().nextstate;
+    if (color[nextstate] == kGrey) return false;
+    if (color[nextstate] == kWhite) {
+      color[nextstate] = kGrey;
+      stack.emplace_back(nextstate, 0);
+    }
+  }
+  std::reverse(order.begin(), order.end());
+  return true;
+}
+
+// Relaxes the arcs leaving the state; calls push(nextstate) for each state
+// whose distance is strictly improved.
+template <class Arc, class Push>
+void Relax(const Fst<Arc> &fst, typename Arc::StateId state,
+           BestPathBuffers<Arc> *buffers, Push push) {
+  auto &distance = buffers->distance;
+  const auto weight = distance[state];
+  size_t pos = 0;
+  for (ArcIterator<Fst<Arc>> aiter(fst, state); !aiter.Done();
+       aiter.Next(), ++pos) {
+    const auto &arc = aiter.Value();
+    auto &nextdistance = distance[arc.nextstate];
+    const auto candidate = Times(weight, arc.weight);
+    if (Plus(nextdistance, candidate) != nextdistance) {
+      nextdistance = candidate;
+      buffers->parent[arc.nextstate] = {state, pos};
+      push(arc.nextstate);
+    }
+  }
+}
+
+}  // namespace internal
+
+// Appends the non-epsilon output labels of the best path through the FST to
+// the output container and, if weight is non-null, stores the path weight
+// there. Returns false, leaving the output container as it was, if the FST has
+// no successful path. Ties are broken in favor of the path found first. The
+// weight must have the path property.
+template <class Arc, class Container>
+bool BestPath(const Fst<Arc> &fst, Container *output,
+              typename Arc::Weight *weight = nullptr,
+              BestPathBuffers<Arc> *buffers = nullptr) {
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+  static_assert(Weight::Properties() & kPath,
+                "BestPath requires a weight with the path property");
+  BestPathBuffers<Arc> local_buffers;
+  if (!buffers) buffers = &local_buffers;
+  const auto start = fst.Start();
+  if (start == kNoStateId) return false;
+  const StateId num_states = CountStates(fst);
+  auto &distance = buffers->distance;
+  auto &parent = buffers->parent;
+  distance.assign(num_states, Weight::Zero());
+  parent.assign(num_states, {kNoStateId, 0});
+  buffers->color.assign(num_states, 0);
+  distance[start] = Weight::One();
+  auto final_distance = Weight::Zero();
+  StateId final_state = kNoStateId;
+  const auto relax_final = [&](StateId state) {
+    const auto final_weight = fst.Final(state);
+    if (final_weight == Weight::Zero()) return;
+    const auto candidate = Times(distance[state], final_weight);
+    if (Plus(final_distance, candidate) != final_distance) {
+      final_distance = candidate;
+      final_state = state;
+    }
+  };
+  if (fst.Properties(kTopSorted, false) == kTopSorted) {
+    for (StateId state = start; state < num_states; ++state) {
+      if (distance[state] == Weight::Zero()) continue;
+      relax_final(state);
+      internal::Relax(fst, state, buffers, [](StateId) {});
+    }
+  } else if (internal::TopOrder(fst, buffers)) {
+    for (const auto state : buffers->order) {
+      relax_final(state);
+      internal::Relax(fst, state, buffers, [](StateId) {});
+    }
+  } else {
+    // Best-first search, re-inserting states whose distance improves; stale
+    // heap entries are skipped when popped.
+    auto &heap = buffers->heap;
+    const auto greater = [](const std::pair<Weight, StateId> &x,
+                            const std::pair<Weight, StateId> &y) {
+      return NaturalLess<Weight>()(y.first, x.first);
+    };
+    heap.clear();
+    heap.emplace_back(distance[start], start);
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), greater);
+      const auto [state_distance, state] = heap.back();
+      heap.pop_back();
+      if (state_distance != distance[state]) continue;
+      internal::Relax(fst, state, buffers, [&](StateId nextstate) {
+        heap.emplace_back(distance[nextstate], nextstate);
+        std::push_heap(heap.begin(), heap.end(), greater);
+      });
+    }
+    for (StateId state = 0; state < num_states; ++state) {
+      if (distance[state] != Weight::Zero()) relax_final(state);
+    }
+  }
+  if (final_state == kNoStateId) return false;
+  // Follows the back-pointers from the final state to the start state.
+  auto &labels = buffers->labels;
+  labels.clear();
+  for (auto state = final_state; parent[state].first != kNoStateId;
+       state = parent[state].first) {
+    ArcIterator<Fst<Arc>> aiter(fst, parent[state].first);
+    aiter.Seek(parent[state].second);
+    if (aiter.Value().olabel != 0) labels.push_back(aiter.Value().olabel);
+  }
+  for (auto it = labels.rbegin(); it != labels.rend(); ++it) {
+    output->push_back(static_cast<typename Container::value_type>(*it));
+  }
+  if (weight) *weight = final_distance;
+  return true;
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_BESTPATH_H_
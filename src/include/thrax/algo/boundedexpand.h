@@ -0,0 +1,61 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_BOUNDEDEXPAND_H_
+#define FST_UTIL_OPERATORS_BOUNDEDEXPAND_H_
+
+// Expansion of (typically delayed) FSTs into mutable FSTs, giving up if the
+// result would exceed a size budget.
+
+#include <cstdint>
+
+#include <fst/fst.h>
+#include <fst/mutable-fst.h>
+
+namespace fst {
+
+// Replaces the contents of the mutable FST with the states and arcs of the
+// input FST, visited in state order. Returns false as soon as there are more
+// than max_states states or max_arcs arcs, in which case the output is left
+// partially expanded; a negative limit means no limit. Also returns false, with
+// the error property set on the output, if the input FST turns out to be in
+// error, as delayed FSTs whose construction fails are. Unlike assignment, this
+// reuses the storage of the output FST.
+template <class Arc>
+bool BoundedExpand(const Fst<Arc> &ifst, MutableFst<Arc> *ofst,
+                   int64_t max_states = -1, int64_t max_arcs = -1) {
+  ofst->DeleteStates();
+  int64_t num_arcs = 0;
+  for (StateIterator<Fst<Arc>> siter(ifst); !siter.Done(); siter.Next()) {
+    const auto state = siter.Value();
+    if (max_states >= 0 && state >= max_states) return false;
+    while (ofst->NumStates() <= state) ofst->AddState();
+    ofst->SetFinal(state, ifst.Final(state));
+    for (ArcIterator<Fst<Arc>> aiter(ifst, state); !aiter.Done();
+         aiter.Next()) {
+      if (max_arcs >= 0 && ++num_arcs > max_arcs) return false;
+      ofst->AddArc(state, aiter.Value());
+    }
+  }
+  ofst->SetStart(ifst.Start());
+  if (ifst.Properties(kError, false)) {
+    ofst->SetProperties(kError, kError);
+    return false;
+  }
+  return true;
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_BOUNDEDEXPAND_H_
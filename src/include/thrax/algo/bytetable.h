@@ -0,0 +1,218 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_BYTETABLE_H_
+#define FST_UTIL_OPERATORS_BYTETABLE_H_
+
+// Direct-indexed transition tables for input-label-sorted FSTs over bytes,
+// and a matcher which uses them.
+//
+// The SortedMatcher finds the arcs with a given input label by binary search
+// in the state's arcs. For states with many arcs, such as sigma-star loops and
+// the marker states of context-dependent rewrites, ByteTables stores the
+// position of the first arc with each of the 256 byte labels, so that the
+// ByteTableMatcher finds byte labels in constant time. States with fewer arcs,
+// and labels beyond the byte range, are searched as usual.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <fst/expanded-fst.h>
+#include <fst/fst.h>
+#include <fst/matcher.h>
+#include <fst/properties.h>
+
+namespace fst {
+
+template <class Arc>
+class ByteTables {
+ public:
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+
+  static constexpr Label kNumBytes = 256;
+
+  // Builds tables for the states with at least min_arcs arcs. The FST must be
+  // sorted by input label.
+  ByteTables(const Fst<Arc> &fst, size_t min_arcs);
+
+  // Returns the state's table, or nullptr if it has none. Entry i of the table
+  // is the position of the first arc whose input label is at least i, for i
+  // from 0 to kNumBytes inclusive.
+  const uint32_t *Table(StateId state) const {
+    if (state < 0 || state >= static_cast<StateId>(index_.size())) {
+      return nullptr;
+    }
+    const auto index = index_[state];
+    return index < 0 ? nullptr : &offsets_[index * (kNumBytes + 1)];
+  }
+
+  size_t NumTables() const { return offsets_.size() / (kNumBytes + 1); }
+
+  // Approximate memory used by the tables.
+  size_t SizeBytes() const {
+    return index_.size() * sizeof(index_[0]) +
+           offsets_.size() * sizeof(offsets_[0]);
+  }
+
+ private:
+  std::vector<int32_t> index_;
+  std::vector<uint32_t> offsets_;
+};
+
+template <class Arc>
+ByteTables<Arc>::ByteTables(const Fst<Arc> &fst, size_t min_arcs) {
+  index_.assign(CountStates(fst), -1);
+  for (StateIterator<Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
+    const auto state = siter.Value();
+    if (fst.NumArcs(state) < min_arcs) continue;
+    index_[state] = NumTables();
+    uint32_t pos = 0;
+    ArcIterator<Fst<Arc>> aiter(fst, state);
+    for (Label label = 0; label <= kNumBytes; ++label) {
+      for (; !aiter.Done() && aiter.Value().ilabel < label; aiter.Next()) {
+        ++pos;
+      }
+      offsets_.push_back(pos);
+    }
+  }
+}
+
+// Matches input labels, like SortedMatcher<F> with MATCH_INPUT, using byte
+// tables where the state has one. The FST must be sorted by input label, and
+// the tables, which are not owned, must have been built from it.
+template <class F>
+class ByteTableMatcher : public MatcherBase<typename F::Arc> {
+ public:
+  using FST = F;
+  using Arc = typename FST::Arc;
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+
+  ByteTableMatcher(const FST &fst, const ByteTables<Arc> *tables)
+      : owned_fst_(fst.Copy()),
+        fst_(*owned_fst_),
+        tables_(tables),
+        loop_(kNoLabel, 0, Weight::One(), kNoStateId) {}
+
+  // As with SortedMatcher, this makes no copy of the FST, which must outlive
+  // the matcher; copies of the matcher copy it.
+  ByteTableMatcher(const FST *fst, const ByteTables<Arc> *tables)
+      : fst_(*fst),
+        tables_(tables),
+        loop_(kNoLabel, 0, Weight::One(), kNoStateId) {}
+
+  ByteTableMatcher(const ByteTableMatcher &matcher, bool safe = false)
+      : owned_fst_(matcher.fst_.Copy(safe)),
+        fst_(*owned_fst_),
+        tables_(matcher.tables_),
+        loop_(matcher.loop_) {}
+
+  ByteTableMatcher *Copy(bool safe = false) const override {
+    return new ByteTableMatcher(*this, safe);
+  }
+
+  MatchType Type(bool test) const override {
+    const auto props = fst_.Properties(kILabelSorted, test);
+    if (props & kILabelSorted) return MATCH_INPUT;
+    return test ? MATCH_NONE : MATCH_UNKNOWN;
+  }
+
+  void SetState(StateId state) final {
+    if (state_ == state) return;
+    state_ = state;
+    aiter_.emplace(fst_, state);
+    num_arcs_ = fst_.NumArcs(state);
+    table_ = tables_->Table(state);
+    loop_.nextstate = state;
+  }
+
+  bool Find(Label match_label) final {
+    current_loop_ = match_label == 0;
+    match_label_ = match_label == kNoLabel ? 0 : match_label;
+    return Search() || current_loop_;
+  }
+
+  bool Done() const final {
+    if (current_loop_) return false;
+    if (aiter_->Done()) return true;
+    return aiter_->Value().ilabel != match_label_;
+  }
+
+  const Arc &Value() const final {
+    return current_loop_ ? loop_ : aiter_->Value();
+  }
+
+  void Next() final {
+    if (current_loop_) {
+      current_loop_ = false;
+    } else {
+      aiter_->Next();
+    }
+  }
+
+  Weight Final(StateId state) const final { return fst_.Final(state); }
+
+  ssize_t Priority(StateId state) final { return fst_.NumArcs(state); }
+
+  const FST &GetFst() const override { return fst_; }
+
+  uint64_t Properties(uint64_t inprops) const override { return inprops; }
+
+ private:
+  // Positions the arc iterator at the first arc with the match label, if any.
+  bool Search() {
+    const auto label = match_label_;
+    size_t low = 0;
+    if (table_) {
+      if (label < ByteTables<Arc>::kNumBytes) {
+        aiter_->Seek(table_[label]);
+        return table_[label] < table_[label + 1];
+      }
+      low = table_[ByteTables<Arc>::kNumBytes];
+    }
+    auto high = num_arcs_;
+    while (low < high) {
+      const auto mid = low + (high - low) / 2;
+      aiter_->Seek(mid);
+      if (aiter_->Value().ilabel < label) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    aiter_->Seek(low);
+    return low < num_arcs_ && aiter_->Value().ilabel == label;
+  }
+
+  std::unique_ptr<const FST> owned_fst_;
+  const FST &fst_;
+  const ByteTables<Arc> *tables_;
+  StateId state_ = kNoStateId;
+  std::optional<ArcIterator<FST>> aiter_;
+  size_t num_arcs_ = 0;
+  const uint32_t *table_ = nullptr;
+  Label match_label_ = kNoLabel;
+  bool current_loop_ = false;
+  // The implicit epsilon self-loop.
+  Arc loop_;
+};
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_BYTETABLE_H_
@@ -0,0 +1,120 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_COMPACT_H_
+#define FST_UTIL_OPERATORS_COMPACT_H_
+
+// Selection of a compact, read-only representation for an FST.
+//
+// A VectorFst arc takes 16 bytes (for 32-bit labels and weights), and each
+// state carries a std::vector and a final weight besides. CompactFsts store
+// only what the FST needs: an unweighted transducer arc, for instance, takes
+// 12 bytes, an unweighted acceptor arc 8, and a string arc 4, and states are
+// represented by a single offset.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include <fst/compact-fst.h>
+#include <fst/const-fst.h>
+#include <fst/fst.h>
+#include <fst/properties.h>
+#include <fst/vector-fst.h>
+
+namespace fst {
+
+// Returns the approximate heap memory used by the FST when held as a
+// VectorFst.
+template <class Arc>
+size_t VectorFstBytes(const Fst<Arc> &fst) {
+  size_t bytes = 0;
+  for (StateIterator<Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
+    bytes += sizeof(VectorState<Arc>) + sizeof(VectorState<Arc> *) +
+             fst.NumArcs(siter.Value()) * sizeof(Arc);
+  }
+  return bytes;
+}
+
+namespace internal {
+
+// Builds the CompactFst, and stores its approximate size in bytes, unless that
+// is not below max_bytes, in which case nothing is built.
+template <class Compactor, class Arc>
+std::unique_ptr<Fst<Arc>> MakeCompactFst(const Fst<Arc> &fst,
+                                         size_t num_elements,
+                                         size_t num_offsets, size_t max_bytes,
+                                         size_t *bytes) {
+  *bytes = num_elements * sizeof(typename Compactor::Element) +
+           num_offsets * sizeof(uint32_t);
+  if (*bytes >= max_bytes) return nullptr;
+  return std::make_unique<CompactArcFst<Arc, Compactor, uint32_t>>(fst);
+}
+
+}  // namespace internal
+
+// Returns a copy of the FST in the smallest CompactFst encoding able to
+// represent it (for strings, unweighted acceptors, unweighted transducers, or
+// weighted acceptors), or as a ConstFst if there is none, and stores its
+// approximate size in bytes. The size is estimated from the numbers of states,
+// arcs and final states before anything is built; if it is not below
+// max_bytes, returns nullptr without building the copy.
+template <class Arc>
+std::unique_ptr<Fst<Arc>> CompactCopy(const Fst<Arc> &fst, size_t *bytes,
+                                      size_t max_bytes = SIZE_MAX) {
+  using Weight = typename Arc::Weight;
+  const auto props =
+      fst.Properties(kString | kAcceptor | kUnweighted, /*test=*/true);
+  size_t num_states = 0;
+  size_t num_arcs = 0;
+  size_t num_finals = 0;
+  for (StateIterator<Fst<Arc>> siter(fst); !siter.Done(); siter.Next()) {
+    const auto state = siter.Value();
+    ++num_states;
+    num_arcs += fst.NumArcs(state);
+    if (fst.Final(state) != Weight::Zero()) ++num_finals;
+  }
+  // Variable-size encodings store an element for each arc and final weight,
+  // and an offset for each state; string encodings store one element for
+  // each state.
+  const auto num_elements = num_arcs + num_finals;
+  if ((props & kString) && (props & kAcceptor)) {
+    if (props & kUnweighted) {
+      return internal::MakeCompactFst<StringCompactor<Arc>>(
+          fst, num_states, 0, max_bytes, bytes);
+    }
+    return internal::MakeCompactFst<WeightedStringCompactor<Arc>>(
+        fst, num_states, 0, max_bytes, bytes);
+  }
+  if (props & kUnweighted) {
+    if (props & kAcceptor) {
+      return internal::MakeCompactFst<UnweightedAcceptorCompactor<Arc>>(
+          fst, num_elements, num_states + 1, max_bytes, bytes);
+    }
+    return internal::MakeCompactFst<UnweightedCompactor<Arc>>(
+        fst, num_elements, num_states + 1, max_bytes, bytes);
+  }
+  if (props & kAcceptor) {
+    return internal::MakeCompactFst<AcceptorCompactor<Arc>>(
+        fst, num_elements, num_states + 1, max_bytes, bytes);
+  }
+  *bytes = num_states * (sizeof(Weight) + 3 * sizeof(uint32_t)) +
+           num_arcs * sizeof(Arc);
+  if (*bytes >= max_bytes) return nullptr;
+  return std::make_unique<ConstFst<Arc>>(fst);
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_COMPACT_H_
@@ -0,0 +1,157 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_DOMAIN_H_
+#define FST_UTIL_OPERATORS_DOMAIN_H_
+
+// Membership in the domain of an FST: the set of input strings it accepts.
+//
+// Composing a string with the FST answers the question, but builds the whole
+// output lattice. DomainAcceptor instead holds the minimal deterministic
+// unweighted acceptor of the FST's input projection, so that membership is a
+// single walk over the string, taking one binary search among the arcs of
+// each state visited.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fst/arc-map.h>
+#include <fst/arcsort.h>
+#include <fst/determinize.h>
+#include <fst/fst.h>
+#include <fst/memory.h>
+#include <fst/minimize.h>
+#include <fst/project.h>
+#include <fst/rmepsilon.h>
+#include <fst/vector-fst.h>
+#include <thrax/algo/boundedexpand.h>
+
+namespace fst {
+
+template <class Arc>
+class DomainAcceptor {
+ public:
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+
+  // Builds the acceptor of the FST's domain. Returns nullptr if the
+  // determinized acceptor would have more than max_states states; a negative
+  // limit means no limit.
+  static std::unique_ptr<DomainAcceptor> Make(const Fst<Arc> &fst,
+                                              int64_t max_states = -1);
+
+  StateId Start() const { return start_; }
+
+  bool Final(StateId state) const { return final_[state]; }
+
+  // Returns the destination of the state's arc with the label, or kNoStateId
+  // if there is none.
+  StateId Next(StateId state, Label label) const {
+    const auto begin = arcs_.begin() + offsets_[state];
+    const auto end = arcs_.begin() + offsets_[state + 1];
+    const auto it = std::lower_bound(
+        begin, end, label, [](const std::pair<Label, StateId> &arc,
+                              Label value) { return arc.first < value; });
+    return it != end && it->first == label ? it->second : kNoStateId;
+  }
+
+  // Returns the state reached from the start state by the labels in
+  // [begin, end), skipping epsilons, or kNoStateId if there is none.
+  template <class Iterator>
+  StateId Walk(Iterator begin, Iterator end) const {
+    auto state = start_;
+    for (; begin != end && state != kNoStateId; ++begin) {
+      const Label label = *begin;
+      if (label != 0) state = Next(state, label);
+    }
+    return state;
+  }
+
+  StateId WalkBytes(std::string_view bytes) const {
+    const auto *begin = reinterpret_cast<const unsigned char *>(bytes.data());
+    return Walk(begin, begin + bytes.size());
+  }
+
+  // Returns true if the labels in [begin, end) form a string of the domain.
+  template <class Iterator>
+  bool Accepts(Iterator begin, Iterator end) const {
+    const auto state = Walk(begin, end);
+    return state != kNoStateId && final_[state];
+  }
+
+  bool AcceptsBytes(std::string_view bytes) const {
+    const auto state = WalkBytes(bytes);
+    return state != kNoStateId && final_[state];
+  }
+
+  StateId NumStates() const { return final_.size(); }
+
+  // Approximate memory used by the acceptor.
+  size_t SizeBytes() const {
+    return sizeof(*this) + offsets_.capacity() * sizeof(offsets_[0]) +
+           arcs_.capacity() * sizeof(arcs_[0]) + final_.capacity() / 8;
+  }
+
+ private:
+  DomainAcceptor() = default;
+
+  StateId start_ = kNoStateId;
+  // The arcs leaving state s, as (label, destination) pairs sorted by label,
+  // are arcs_[offsets_[s]] up to arcs_[offsets_[s + 1]].
+  std::vector<uint32_t> offsets_;
+  std::vector<std::pair<Label, StateId>> arcs_;
+  std::vector<bool> final_;
+};
+
+template <class Arc>
+std::unique_ptr<DomainAcceptor<Arc>> DomainAcceptor<Arc>::Make(
+    const Fst<Arc> &fst, int64_t max_states) {
+  using Weight = typename Arc::Weight;
+  VectorFst<Arc> domain(fst);
+  Project(&domain, ProjectType::INPUT);
+  ArcMap(&domain, RmWeightMapper<Arc>());
+  RmEpsilon(&domain);
+  VectorFst<Arc> dfa;
+  // The determinization is expanded lazily, so that it can be abandoned as
+  // soon as it exceeds the budget.
+  if (!BoundedExpand(DeterminizeFst<Arc>(domain), &dfa, max_states)) {
+    return nullptr;
+  }
+  Minimize(&dfa);
+  ArcSort(&dfa, ILabelCompare<Arc>());
+  auto acceptor = WrapUnique(new DomainAcceptor());
+  acceptor->start_ = dfa.Start();
+  acceptor->offsets_.reserve(dfa.NumStates() + 1);
+  acceptor->final_.reserve(dfa.NumStates());
+  for (StateId state = 0; state < dfa.NumStates(); ++state) {
+    acceptor->offsets_.push_back(acceptor->arcs_.size());
+    acceptor->final_.push_back(dfa.Final(state) != Weight::Zero());
+    for (ArcIterator<VectorFst<Arc>> aiter(dfa, state); !aiter.Done();
+         aiter.Next()) {
+      const auto &arc = aiter.Value();
+      acceptor->arcs_.emplace_back(arc.ilabel, arc.nextstate);
+    }
+  }
+  acceptor->offsets_.push_back(acceptor->arcs_.size());
+  return acceptor;
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_DOMAIN_H_
@@ -0,0 +1,271 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_NBEST_H_
+#define FST_UTIL_OPERATORS_NBEST_H_
+
+// Enumeration of the n best distinct output strings of an FST.
+//
+// ShortestPath() with unique = true requires an epsilon-free acceptor, which
+// it determinizes in full before searching it. Here the output projection of
+// the FST is instead determinized on the fly, by an A* search over output
+// prefixes whose heuristic is the exact distance to a final state. Each search
+// node holds the subset of FST states reached by its prefix (the determinized
+// state) along with their distances from the start state, so only the subsets
+// lying on the way to the n best strings are ever built. Search nodes which
+// cannot beat the n-th best complete string queued so far are discarded.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <fst/expanded-fst.h>
+#include <fst/fst.h>
+#include <fst/properties.h>
+#include <fst/shortest-distance.h>
+#include <fst/weight.h>
+
+namespace fst {
+namespace internal {
+
+template <class Arc>
+class NBestStringSearch {
+ public:
+  using Label = typename Arc::Label;
+  using StateId = typename Arc::StateId;
+  using Weight = typename Arc::Weight;
+
+  explicit NBestStringSearch(const Fst<Arc> &fst) : fst_(fst) {}
+
+  template <class Container>
+  bool Search(size_t n, std::vector<Container> *outputs,
+              std::vector<Weight> *weights);
+
+ private:
+  // A determinized state, reached by the output prefix spelled by following
+  // the parents' labels; its subset is subsets_[begin, end).
+  struct Node {
+    ptrdiff_t parent;
+    Label label;
+    size_t begin;
+    size_t end;
+  };
+
+  // A queued node. If final is true, the entry stands for the complete string
+  // spelled by the node rather than for its extensions.
+  struct Entry {
+    Weight priority;
+    size_t node;
+    bool final;
+  };
+
+  // Orders the entries as a min-heap, breaking ties in favor of complete
+  // strings and then of older nodes.
+  static bool Greater(const Entry &x, const Entry &y) {
+    if (NaturalLess<Weight>()(y.priority, x.priority)) return true;
+    if (NaturalLess<Weight>()(x.priority, y.priority)) return false;
+    if (x.final != y.final) return y.final;
+    return x.node > y.node;
+  }
+
+  // Adds a node whose subset is the output-epsilon closure of the pending
+  // states, and queues it.
+  void AddNode(ptrdiff_t parent, Label label);
+
+  void Push(const Weight &priority, size_t node, bool final);
+
+  // Whether a weight cannot beat the n-th best complete string queued so far.
+  bool Pruned(const Weight &weight) const {
+    return finals_.size() == n_ &&
+           !NaturalLess<Weight>()(weight, finals_.front());
+  }
+
+  const Fst<Arc> &fst_;
+  size_t n_ = 0;
+  // Distance from each state to a final state.
+  std::vector<Weight> future_;
+  std::vector<Node> nodes_;
+  std::vector<std::pair<StateId, Weight>> subsets_;
+  std::vector<Entry> heap_;
+  // Priorities of the n best complete strings queued so far, as a max-heap.
+  std::vector<Weight> finals_;
+  // Scratch storage for building subsets: the states reached and their
+  // distances, and each state's index in pending_ (or -1).
+  std::vector<std::pair<StateId, Weight>> pending_;
+  std::vector<ptrdiff_t> index_;
+  std::vector<size_t> queue_;
+  // Scratch storage for the labeled transitions out of a subset.
+  std::vector<std::pair<Label, std::pair<StateId, Weight>>> moves_;
+};
+
+template <class Arc>
+void NBestStringSearch<Arc>::Push(const Weight &priority, size_t node,
+                                  bool final) {
+  if (priority == Weight::Zero() || Pruned(priority)) return;
+  if (final) {
+    const auto less = NaturalLess<Weight>();
+    if (finals_.size() == n_) {
+      std::pop_heap(finals_.begin(), finals_.end(), less);
+      finals_.back() = priority;
+    } else {
+      finals_.push_back(priority);
+    }
+    std::push_heap(finals_.begin(), finals_.end(), less);
+  }
+  heap_.push_back({priority, node, final});
+  std::push_heap(heap_.begin(), heap_.end(), Greater);
+}
+
+template <class Arc>
+void NBestStringSearch<Arc>::AddNode(ptrdiff_t parent, Label label) {
+  // Computes the closure under output epsilons by relaxing until no distance
+  // improves.
+  queue_.clear();
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    index_[pending_[i].first] = i;
+    queue_.push_back(i);
+  }
+  while (!queue_.empty()) {
+    const auto i = queue_.back();
+    queue_.pop_back();
+    const auto state = pending_[i].first;
+    const auto distance = pending_[i].second;
+    for (ArcIterator<Fst<Arc>> aiter(fst_, state); !aiter.Done();
+         aiter.Next()) {
+      const auto &arc = aiter.Value();
+      if (arc.olabel != 0 || future_[arc.nextstate] == Weight::Zero()) {
+        continue;
+      }
+      const auto candidate = Times(distance, arc.weight);
+      auto &j = index_[arc.nextstate];
+      if (j < 0) {
+        j = pending_.size();
+        pending_.emplace_back(arc.nextstate, candidate);
+        queue_.push_back(j);
+      } else if (Plus(pending_[j].second, candidate) != pending_[j].second) {
+        pending_[j].second = candidate;
+        queue_.push_back(j);
+      }
+    }
+  }
+  auto priority = Weight::Zero();
+  auto final_weight = Weight::Zero();
+  const auto begin = subsets_.size();
+  for (const auto &[state, distance] : pending_) {
+    index_[state] = -1;
+    priority = Plus(priority, Times(distance, future_[state]));
+    final_weight = Plus(final_weight, Times(distance, fst_.Final(state)));
+    subsets_.emplace_back(state, distance);
+  }
+  pending_.clear();
+  const auto node = nodes_.size();
+  nodes_.push_back({parent, label, begin, subsets_.size()});
+  Push(final_weight, node, /*final=*/true);
+  Push(priority, node, /*final=*/false);
+}
+
+template <class Arc>
+template <class Container>
+bool NBestStringSearch<Arc>::Search(size_t n, std::vector<Container> *outputs,
+                                    std::vector<Weight> *weights) {
+  outputs->clear();
+  if (weights) weights->clear();
+  const auto start = fst_.Start();
+  if (n == 0 || start == kNoStateId) return false;
+  n_ = n;
+  ShortestDistance(fst_, &future_, /*reverse=*/true);
+  // States which cannot reach a final state may be missing from the end.
+  const StateId num_states = CountStates(fst_);
+  future_.resize(num_states, Weight::Zero());
+  if (future_[start] == Weight::Zero()) return false;
+  index_.assign(num_states, -1);
+  pending_.emplace_back(start, Weight::One());
+  AddNode(-1, 0);
+  while (!heap_.empty() && outputs->size() < n) {
+    std::pop_heap(heap_.begin(), heap_.end(), Greater);
+    const auto entry = heap_.back();
+    heap_.pop_back();
+    if (entry.final) {
+      outputs->emplace_back();
+      auto &output = outputs->back();
+      for (auto i = static_cast<ptrdiff_t>(entry.node); nodes_[i].parent >= 0;
+           i = nodes_[i].parent) {
+        output.push_back(
+            static_cast<typename Container::value_type>(nodes_[i].label));
+      }
+      std::reverse(output.begin(), output.end());
+      if (weights) weights->push_back(entry.priority);
+      continue;
+    }
+    // Finals queued since the entry was pushed may now rule it out.
+    if (Pruned(entry.priority)) continue;
+    // Collects the labeled transitions out of the subset, grouped by label.
+    moves_.clear();
+    const auto &node = nodes_[entry.node];
+    for (auto i = node.begin; i < node.end; ++i) {
+      const auto [state, distance] = subsets_[i];
+      for (ArcIterator<Fst<Arc>> aiter(fst_, state); !aiter.Done();
+           aiter.Next()) {
+        const auto &arc = aiter.Value();
+        if (arc.olabel == 0 || future_[arc.nextstate] == Weight::Zero()) {
+          continue;
+        }
+        moves_.push_back(
+            {arc.olabel, {arc.nextstate, Times(distance, arc.weight)}});
+      }
+    }
+    std::sort(moves_.begin(), moves_.end(),
+              [](const auto &x, const auto &y) {
+                return x.first != y.first ? x.first < y.first
+                                          : x.second.first < y.second.first;
+              });
+    for (size_t i = 0; i < moves_.size();) {
+      const auto label = moves_[i].first;
+      for (; i < moves_.size() && moves_[i].first == label; ++i) {
+        const auto &[nextstate, distance] = moves_[i].second;
+        if (!pending_.empty() && pending_.back().first == nextstate) {
+          pending_.back().second = Plus(pending_.back().second, distance);
+        } else {
+          pending_.emplace_back(nextstate, distance);
+        }
+      }
+      AddNode(entry.node, label);
+    }
+  }
+  return !outputs->empty();
+}
+
+}  // namespace internal
+
+// Stores the n best distinct strings of output labels of the FST, without
+// epsilons, in the outputs in order of increasing weight and, if weights is
+// non-null, stores their weights there. Fewer than n strings are returned if
+// the FST has fewer. Returns false if it has none. Strings of equal weight are
+// returned in no particular order. The weight must have the path property,
+// and must be monotone (as are non-negative tropical weights).
+template <class Arc, class Container>
+bool NBestStrings(const Fst<Arc> &fst, size_t n,
+                  std::vector<Container> *outputs,
+                  std::vector<typename Arc::Weight> *weights = nullptr) {
+  static_assert(Arc::Weight::Properties() & kPath,
+                "NBestStrings requires a weight with the path property");
+  internal::NBestStringSearch<Arc> search(fst);
+  return search.Search(n, outputs, weights);
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_NBEST_H_
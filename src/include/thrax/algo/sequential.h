@@ -0,0 +1,130 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+#ifndef FST_UTIL_OPERATORS_SEQUENTIAL_H_
+#define FST_UTIL_OPERATORS_SEQUENTIAL_H_
+
+// Direct application of sequential transducers to strings.
+//
+// A transducer is sequential if it is deterministic on its input side and has
+// no input epsilons. For such a transducer T and a string x there is at most
+// one path in T whose input side is x, so the single output of x @ T can be
+// read off by walking T along x, without constructing a string FST for x or
+// the composition x @ T.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <fst/fst.h>
+#include <fst/properties.h>
+#include <string_view>
+
+namespace fst {
+
+constexpr uint64_t kSequentialProperties = kIDeterministic | kNoIEpsilons;
+
+// Returns true if the FST is known to be sequential. If test is true, the
+// relevant properties are computed if unknown; FSTs which cache their
+// properties will then answer cheaply on subsequent calls with test = false.
+template <class Arc>
+bool IsSequential(const Fst<Arc> &fst, bool test = false) {
+  return fst.Properties(kSequentialProperties, test) == kSequentialProperties;
+}
+
+namespace internal {
+
+// Positions the arc iterator at the first arc with the given input label,
+// using binary search if the arcs are sorted by input label. Returns false if
+// there is no such arc.
+template <class Arc>
+bool FindInputLabel(typename Arc::Label label, size_t narcs, bool sorted,
+                    ArcIterator<Fst<Arc>> *aiter) {
+  if (sorted) {
+    size_t low = 0;
+    size_t high = narcs;
+    while (low < high) {
+      const auto mid = low + (high - low) / 2;
+      aiter->Seek(mid);
+      if (aiter->Value().ilabel < label) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    aiter->Seek(low);
+  } else {
+    while (!aiter->Done() && aiter->Value().ilabel != label) aiter->Next();
+  }
+  return !aiter->Done() && aiter->Value().ilabel == label;
+}
+
+}  // namespace internal
+
+// Walks the sequential FST along the input labels in [begin, end), appending
+// the non-epsilon output labels to the output container and, if weight is
+// non-null, storing the path weight there. Epsilons in the input (such as NUL
+// bytes) are skipped, as composition with a string FST would match them
+// without moving in the FST. Returns false, leaving the output container as
+// it was, if the input is not accepted. The result is undefined if the FST is
+// not sequential.
+template <class Arc, class Iterator, class Container>
+bool SequentialApply(const Fst<Arc> &fst, Iterator begin, Iterator end,
+                     Container *output,
+                     typename Arc::Weight *weight = nullptr) {
+  using Label = typename Arc::Label;
+  using Weight = typename Arc::Weight;
+  const auto size = output->size();
+  const bool sorted = fst.Properties(kILabelSorted, false) == kILabelSorted;
+  auto state = fst.Start();
+  auto path_weight = Weight::One();
+  for (; begin != end && state != kNoStateId; ++begin) {
+    const Label label = *begin;
+    if (label == 0) continue;
+    ArcIterator<Fst<Arc>> aiter(fst, state);
+    if (!internal::FindInputLabel<Arc>(label, fst.NumArcs(state), sorted,
+                                       &aiter)) {
+      state = kNoStateId;
+      break;
+    }
+    const auto &arc = aiter.Value();
+    if (arc.olabel != 0) {
+      output->push_back(
+          static_cast<typename Container::value_type>(arc.olabel));
+    }
+    path_weight = Times(path_weight, arc.weight);
+    state = arc.nextstate;
+  }
+  if (state != kNoStateId) path_weight = Times(path_weight, fst.Final(state));
+  if (state == kNoStateId || path_weight == Weight::Zero()) {
+    output->resize(size);
+    return false;
+  }
+  if (weight) *weight = path_weight;
+  return true;
+}
+
+// Byte-string variant of the above: each byte of the input is a label, and each
+// output label is appended to the output string as a byte.
+template <class Arc>
+bool SequentialApply(const Fst<Arc> &fst, std::string_view input,
+                     std::string *output,
+                     typename Arc::Weight *weight = nullptr) {
+  const auto *begin = reinterpret_cast<const unsigned char *>(input.data());
+  return SequentialApply(fst, begin, begin + input.size(), output, weight);
+}
+
+}  // namespace fst
+
+#endif  // FST_UTIL_OPERATORS_SEQUENTIAL_H_
@@ -0,0 +1,130 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A minimal fixed-size thread pool, standing in for the one in the internal
+// threading library.
+
+#ifndef THRAX_COMPAT_THREAD_POOL_H_
+#define THRAX_COMPAT_THREAD_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace thrax {
+
+class ThreadPool {
+ public:
+  // Starts the given number of worker threads (at least one).
+  explicit ThreadPool(int num_threads) {
+    num_threads = std::max(num_threads, 1);
+    threads_.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.emplace_back([this] { Work(); });
+    }
+  }
+
+  // Runs all scheduled tasks to completion, then joins the workers.
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cond_.notify_all();
+    for (auto& thread : threads_) thread.join();
+  }
+
+  int NumThreads() const { return threads_.size(); }
+
+  void Schedule(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push_back(std::move(task));
+    }
+    cond_.notify_one();
+  }
+
+ private:
+  void Work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return done_ || !tasks_.empty(); });
+        if (tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool done_ = false;
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+};
+
+// Runs num_workers instances of the worker function on the pool and blocks
+// until all of them have returned. If the pool is null, a single instance is
+// run on the calling thread instead. This must not be called from one of the
+// pool's own threads.
+inline void RunWorkers(ThreadPool* pool, int num_workers,
+                       const std::function<void()>& worker) {
+  if (!pool || num_workers <= 1) {
+    worker();
+    return;
+  }
+  std::mutex mutex;
+  std::condition_variable cond;
+  int pending = num_workers;
+  for (int i = 0; i < num_workers; ++i) {
+    pool->Schedule([&] {
+      worker();
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--pending == 0) cond.notify_one();
+    });
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [&] { return pending == 0; });
+}
+
+// Calls fn(i) for each i in [0, n), spread over the threads of the pool (or on
+// the calling thread if the pool is null), and blocks until all calls have
+// returned. Indices are handed out one at a time, so this suits a modest
+// number of costly, independent work items.
+inline void ParallelFor(ThreadPool* pool, size_t n,
+                        const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next(0);
+  const int num_workers =
+      pool ? std::min<size_t>(pool->NumThreads(), n) : 1;
+  RunWorkers(pool, num_workers, [&] {
+    for (auto i = next.fetch_add(1); i < n; i = next.fetch_add(1)) fn(i);
+  });
+}
+
+}  // namespace thrax
+
+#endif  // THRAX_COMPAT_THREAD_POOL_H_
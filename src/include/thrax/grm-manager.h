@@ -19,15 +19,24 @@
 #ifndef NLP_GRM_LANGUAGE_GRM_MANAGER_H_
 #define NLP_GRM_LANGUAGE_GRM_MANAGER_H_
 
+#include <map>
 #include <memory>
+#include <string>
 
 #include <fst/compat.h>
 #include <thrax/compat/compat.h>
 #include <fst/flags.h>
 #include <thrax/compat/utils.h>
 #include <fst/extensions/far/far.h>
+#include <fst/const-fst.h>
+#include <fst/vector-fst.h>
 #include <thrax/abstract-grm-manager.h>
+#include <thrax/algo/sequential.h>
+#include <thrax/indexed-far.h>
+#include <thrax/prepared-far.h>
 
+DECLARE_bool(mappable_far);  // From util/flags.cc.
+DECLARE_bool(prepared_far);  // From util/flags.cc.
 DECLARE_string(outdir);  // From util/flags.cc.
 
 namespace thrax {
@@ -41,34 +50,50 @@ class GrmManagerSpec : public AbstractGrmManager<Arc> {
 
   GrmManagerSpec() : Base() {}
 
+  explicit GrmManagerSpec(const GrmManagerOptions &opts) : Base(opts) {}
+
   ~GrmManagerSpec() override {}
 
   // Loads up the FSTs from a FAR file. Returns true on success and false
-  // otherwise.
+  // otherwise. If the map_archive option is set, rules stored as aligned
+  // ConstFsts are memory-mapped from the archive. If the lazy_load option is
+  // set, rules are only read when first used. Otherwise, rules are read and
+  // prepared on as many threads as the load_threads option allows.
   bool LoadArchive(const std::string &filename);
 
   // This function will write the created FSTs into an FST archive with the
-  // provided filename.
+  // provided filename. If --mappable_far is set, the rules are written as
+  // input-sorted, aligned ConstFsts, which can be memory-mapped on loading.
+  // If --prepared_far is set, they are written as a prepared archive (see
+  // thrax/prepared-far.h).
   void ExportFar(const std::string &filename) const override;
 
  private:
+  // Writes the rules as input-sorted, aligned ConstFsts, along with their
+  // artifacts and the manifest if prepared is true.
+  void ExportMappableFar(const std::string &out_path,
+                         bool prepared = false) const;
+
   GrmManagerSpec(const GrmManagerSpec &) = delete;
   GrmManagerSpec &operator=(const GrmManagerSpec &) = delete;
 };
 
 template <typename Arc>
 bool GrmManagerSpec<Arc>::LoadArchive(const std::string &filename) {
-  std::unique_ptr<::fst::FarReader<Arc>> reader(
-#ifndef NO_GOOGLE
-      ::fst::STTableFarReader<Arc>::Open(filename));
-#else
-      ::fst::STTableFarReader<Arc>::Open(filename));
-#endif  // NO_GOOGLE
+  const auto &opts = Base::GetOptions();
+  // The indexed reader, unlike the sequential FarReader, can read rules
+  // concurrently and recognizes prepared archives.
+  auto reader = IndexedFarReader<Arc>::Open(
+      filename, opts.map_archive ? ::fst::FstReadOptions::MAP
+                                 : ::fst::FstReadOptions::READ);
   if (!reader) {
     LOG(ERROR) << "Unable to open FAR: " << filename;
     return false;
   }
-  return Base::LoadArchive(reader.get(), filename);
+  if (opts.lazy_load) {
+    return Base::LoadArchiveLazily(std::move(reader), filename);
+  }
+  return Base::LoadArchive(*reader, filename);
 }
 
 template <typename Arc>
@@ -81,6 +106,10 @@ void GrmManagerSpec<Arc>::ExportFar(const std::string &filename) const {
 
   const std::string out_path(
       JoinPath(FST_FLAGS_outdir, filename));
+  if (FST_FLAGS_mappable_far || FST_FLAGS_prepared_far) {
+    ExportMappableFar(out_path, FST_FLAGS_prepared_far);
+    return;
+  }
   std::unique_ptr<::fst::FarWriter<Arc>> writer(
 #ifndef NO_GOOGLE
       ::fst::STTableFarWriter<Arc>::Create(out_path));
@@ -97,6 +126,61 @@ void GrmManagerSpec<Arc>::ExportFar(const std::string &filename) const {
   }
 }
 
+template <typename Arc>
+void GrmManagerSpec<Arc>::ExportMappableFar(const std::string &out_path,
+                                            bool prepared) const {
+  const auto writer = IndexedFarWriter<Arc>::Create(out_path);
+  if (!writer) {
+    LOG(FATAL) << "Failed to create writer for: " << out_path;
+  }
+  static const ::fst::ILabelCompare<Arc> icomp;
+  // Artifact keys sort among the rule names, so for prepared archives all
+  // entries are built before any is written.
+  std::map<std::string, std::unique_ptr<const ::fst::Fst<Arc>>> entries;
+  PreparedFarManifest manifest;
+  const auto add = [&writer](const std::string &key,
+                             const ::fst::Fst<Arc> &fst) {
+    VLOG(1) << "Writing FST: " << key;
+    if (!writer->Add(key, fst)) LOG(FATAL) << "Failed to write FST: " << key;
+  };
+  const auto &fsts = Base::GetFstMap();
+  for (auto it = fsts.cbegin(); it != fsts.cend(); ++it) {
+    // Artifacts of a prepared archive this was loaded from are rebuilt.
+    if (IsPreparedArtifactKey(it->first)) continue;
+    const auto &fst = *it->second;
+    // Sorting here, rather than on loading, keeps the loaded rules backed by
+    // the mapping. The properties the manager relies on are computed first,
+    // so that they are stored in the header.
+    std::unique_ptr<::fst::ConstFst<Arc>> const_fst;
+    if (fst.Properties(::fst::kILabelSorted, true) == ::fst::kILabelSorted) {
+      ::fst::IsSequential(fst, /*test=*/true);
+      const_fst = std::make_unique<::fst::ConstFst<Arc>>(fst);
+    } else {
+      ::fst::VectorFst<Arc> sorted_fst(fst);
+      ::fst::ArcSort(&sorted_fst, icomp);
+      ::fst::IsSequential(sorted_fst, /*test=*/true);
+      const_fst = std::make_unique<::fst::ConstFst<Arc>>(sorted_fst);
+    }
+    if (!prepared) {
+      add(it->first, *const_fst);
+      continue;
+    }
+    PreparedFarManifest::Rule rule;
+    rule.name = it->first;
+    rule.fingerprint = FstFingerprint(*const_fst);
+    if (Base::UsesLookAhead(*const_fst)) {
+      rule.lookahead = true;
+      entries[kPreparedLookAheadPrefix + it->first] =
+          std::make_unique<typename Base::LookAheadTransducer>(*const_fst);
+    }
+    manifest.rules.push_back(std::move(rule));
+    entries[it->first] = std::move(const_fst);
+  }
+  if (!prepared) return;
+  entries[kPreparedFarManifestKey] = manifest.ToFst<Arc>();
+  for (const auto &[key, fst] : entries) add(key, *fst);
+}
+
 // A lot of code outside this build uses GrmManager with the old meaning of
 // GrmManagerSpec<::fst::StdArc>, forward-declaring it as a class. To
 // obviate the need to change all that outside code, we provide this derived
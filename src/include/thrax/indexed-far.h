@@ -0,0 +1,297 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Random access to, and aligned writing of, FST archives in the STTable
+// format used by STTableFarReader and STTableFarWriter.
+//
+// The stock FAR reader deserializes entries with default read options, so its
+// FSTs are always read into the heap. IndexedFarReader reads the key index at
+// the end of the archive and deserializes entries individually with the
+// requested read mode; in FstReadOptions::MAP mode, ConstFsts written with
+// alignment (as IndexedFarWriter does) are memory-mapped straight from the
+// archive, so loading them allocates almost nothing and the pages are shared
+// by all processes which map the same archive.
+//
+// The files written by IndexedFarWriter are ordinary STTable archives and can
+// be read by any FAR reader.
+
+#ifndef THRAX_INDEXED_FAR_H_
+#define THRAX_INDEXED_FAR_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <ios>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fst/compat.h>
+#include <thrax/compat/compat.h>
+#include <fst/extensions/far/sttable.h>
+#include <fst/log.h>
+#include <fst/fst.h>
+#include <fst/util.h>
+#include <string_view>
+
+namespace thrax {
+
+template <typename Arc>
+class IndexedFarReader {
+ public:
+  using Transducer = ::fst::Fst<Arc>;
+
+  // Opens the archive and reads its key index. Returns nullptr on error.
+  static std::unique_ptr<IndexedFarReader> Open(
+      const std::string& filename,
+      ::fst::FstReadOptions::FileReadMode mode =
+          ::fst::FstReadOptions::READ);
+
+  size_t NumEntries() const { return keys_.size(); }
+
+  const std::string& Key(size_t i) const { return keys_[i]; }
+
+  // Returns the index of the entry with the given key, or NumEntries() if there
+  // is none. Keys are sorted, so this is a binary search.
+  size_t Find(std::string_view key) const;
+
+  // Deserializes the i-th entry using a fresh stream, so different entries may
+  // be read concurrently. Returns nullptr on error.
+  std::unique_ptr<Transducer> ReadFst(size_t i) const {
+    return ReadFstAs<Transducer>(i);
+  }
+
+  // As above, but reading the entry as the given FST type, which need not be
+  // registered.
+  template <typename F>
+  std::unique_ptr<F> ReadFstAs(size_t i) const;
+
+  // Sequential access, mirroring the FarReader interface so that instances can
+  // be passed to AbstractGrmManager::LoadArchive.
+  void Reset() {
+    pos_ = 0;
+    fst_.reset();
+  }
+
+  bool Done() const { return pos_ >= keys_.size(); }
+
+  void Next() {
+    ++pos_;
+    fst_.reset();
+  }
+
+  const std::string& GetKey() const { return keys_[pos_]; }
+
+  // The returned FST is owned by the reader and valid until the next call to
+  // Next() or Reset().
+  const Transducer* GetFst() {
+    if (!fst_) fst_ = ReadFst(pos_);
+    return fst_.get();
+  }
+
+ private:
+  IndexedFarReader(const std::string& filename,
+                   ::fst::FstReadOptions::FileReadMode mode)
+      : filename_(filename), mode_(mode), pos_(0) {}
+
+  const std::string filename_;
+  const ::fst::FstReadOptions::FileReadMode mode_;
+  // Entry keys, in sorted order.
+  std::vector<std::string> keys_;
+  // Offsets of the serialized FSTs (i.e., just past the keys).
+  std::vector<int64_t> offsets_;
+  size_t pos_;
+  std::unique_ptr<Transducer> fst_;
+
+  IndexedFarReader(const IndexedFarReader&) = delete;
+  IndexedFarReader& operator=(const IndexedFarReader&) = delete;
+};
+
+template <typename Arc>
+std::unique_ptr<IndexedFarReader<Arc>> IndexedFarReader<Arc>::Open(
+    const std::string& filename, ::fst::FstReadOptions::FileReadMode mode) {
+  std::ifstream strm(filename, std::ios_base::in | std::ios_base::binary);
+  if (!strm) {
+    LOG(ERROR) << "IndexedFarReader: Could not open " << filename;
+    return nullptr;
+  }
+  int32_t magic_number = 0;
+  int32_t file_version = 0;
+  ::fst::ReadType(strm, &magic_number);
+  ::fst::ReadType(strm, &file_version);
+  if (!strm || magic_number != ::fst::kSTTableMagicNumber ||
+      file_version != ::fst::kSTTableFileVersion) {
+    LOG(ERROR) << "IndexedFarReader: " << filename
+               << " is not an STTable archive";
+    return nullptr;
+  }
+  // The archive ends with the entry positions, as a vector, followed by
+  // their number. Everything read from the index is checked against the size
+  // of the file before it is used to allocate or seek, so that a corrupt or
+  // truncated archive cannot ask for more memory than the file could hold.
+  static constexpr int64_t kHeaderSize =
+      sizeof(magic_number) + sizeof(file_version);
+  static constexpr int64_t kIndexEntrySize = sizeof(int64_t);
+  strm.seekg(0, std::ios_base::end);
+  const int64_t file_size = strm.tellg();
+  int64_t num_entries = -1;
+  if (strm && file_size >= kHeaderSize + 2 * kIndexEntrySize) {
+    strm.seekg(file_size - kIndexEntrySize);
+    ::fst::ReadType(strm, &num_entries);
+  }
+  if (!strm || num_entries < 0 ||
+      num_entries > (file_size - kHeaderSize - 2 * kIndexEntrySize) /
+                        kIndexEntrySize) {
+    LOG(ERROR) << "IndexedFarReader: Corrupt index in " << filename;
+    return nullptr;
+  }
+  // The entries end where the size of the positions vector begins.
+  const int64_t entries_end =
+      file_size - (num_entries + 2) * kIndexEntrySize;
+  std::vector<int64_t> positions(num_entries);
+  strm.seekg(entries_end + kIndexEntrySize);
+  for (auto& position : positions) ::fst::ReadType(strm, &position);
+  auto reader = fst::WrapUnique(new IndexedFarReader(filename, mode));
+  reader->keys_.resize(num_entries);
+  reader->offsets_.resize(num_entries);
+  for (int64_t i = 0; i < num_entries && strm; ++i) {
+    // Each entry begins with its key, a length followed by the bytes.
+    int32_t key_size = 0;
+    if (positions[i] < kHeaderSize ||
+        positions[i] > entries_end - static_cast<int64_t>(sizeof(key_size))) {
+      strm.setstate(std::ios_base::failbit);
+      break;
+    }
+    strm.seekg(positions[i]);
+    ::fst::ReadType(strm, &key_size);
+    if (key_size < 0 ||
+        key_size > entries_end - positions[i] -
+                       static_cast<int64_t>(sizeof(key_size))) {
+      strm.setstate(std::ios_base::failbit);
+      break;
+    }
+    auto& key = reader->keys_[i];
+    key.resize(key_size);
+    strm.read(key.data(), key_size);
+    reader->offsets_[i] = strm.tellg();
+  }
+  if (!strm) {
+    LOG(ERROR) << "IndexedFarReader: Corrupt index in " << filename;
+    return nullptr;
+  }
+  return reader;
+}
+
+template <typename Arc>
+size_t IndexedFarReader<Arc>::Find(std::string_view key) const {
+  const auto it = std::lower_bound(keys_.begin(), keys_.end(), key);
+  return it != keys_.end() && *it == key ? it - keys_.begin() : keys_.size();
+}
+
+template <typename Arc>
+template <typename F>
+std::unique_ptr<F> IndexedFarReader<Arc>::ReadFstAs(size_t i) const {
+  std::ifstream strm(filename_, std::ios_base::in | std::ios_base::binary);
+  strm.seekg(offsets_[i]);
+  if (!strm) {
+    LOG(ERROR) << "IndexedFarReader: Could not seek to " << keys_[i]
+               << " in " << filename_;
+    return nullptr;
+  }
+  // The source must be the archive itself for mapping to take place.
+  ::fst::FstReadOptions opts(filename_);
+  opts.mode = mode_;
+  return fst::WrapUnique(F::Read(strm, opts));
+}
+
+// Writes an STTable archive whose entries are aligned so that they can be
+// memory-mapped on reading. Keys must be added in sorted order.
+template <typename Arc>
+class IndexedFarWriter {
+ public:
+  using Transducer = ::fst::Fst<Arc>;
+
+  // Returns nullptr on error.
+  static std::unique_ptr<IndexedFarWriter> Create(const std::string& filename);
+
+  // Writes the index.
+  ~IndexedFarWriter();
+
+  bool Add(const std::string& key, const Transducer& fst);
+
+  bool Error() const { return !strm_; }
+
+ private:
+  explicit IndexedFarWriter(const std::string& filename)
+      : filename_(filename),
+        strm_(filename, std::ios_base::out | std::ios_base::binary) {}
+
+  const std::string filename_;
+  std::ofstream strm_;
+  std::vector<int64_t> positions_;
+  std::string last_key_;
+
+  IndexedFarWriter(const IndexedFarWriter&) = delete;
+  IndexedFarWriter& operator=(const IndexedFarWriter&) = delete;
+};
+
+template <typename Arc>
+std::unique_ptr<IndexedFarWriter<Arc>> IndexedFarWriter<Arc>::Create(
+    const std::string& filename) {
+  auto writer = fst::WrapUnique(new IndexedFarWriter(filename));
+  ::fst::WriteType(writer->strm_, ::fst::kSTTableMagicNumber);
+  ::fst::WriteType(writer->strm_, ::fst::kSTTableFileVersion);
+  if (writer->Error()) {
+    LOG(ERROR) << "IndexedFarWriter: Could not create " << filename;
+    return nullptr;
+  }
+  return writer;
+}
+
+template <typename Arc>
+IndexedFarWriter<Arc>::~IndexedFarWriter() {
+  ::fst::WriteType(strm_, positions_);
+  ::fst::WriteType(strm_, static_cast<int64_t>(positions_.size()));
+}
+
+template <typename Arc>
+bool IndexedFarWriter<Arc>::Add(const std::string& key,
+                                const Transducer& fst) {
+  if (key.empty()) {
+    LOG(ERROR) << "IndexedFarWriter: Key empty";
+    return false;
+  }
+  if (!positions_.empty() && key <= last_key_) {
+    LOG(ERROR) << "IndexedFarWriter: Keys out of order: " << last_key_
+               << " " << key;
+    return false;
+  }
+  positions_.push_back(strm_.tellp());
+  ::fst::WriteType(strm_, key);
+  last_key_ = key;
+  const ::fst::FstWriteOptions opts(filename_, /*write_header=*/true,
+                                    /*write_isymbols=*/true,
+                                    /*write_osymbols=*/true,
+                                    /*align=*/true);
+  if (!fst.Write(strm_, opts)) {
+    LOG(ERROR) << "IndexedFarWriter: Could not write " << key << " to "
+               << filename_;
+    return false;
+  }
+  return true;
+}
+
+}  // namespace thrax
+
+#endif  // THRAX_INDEXED_FAR_H_
@@ -0,0 +1,212 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// The manifest of a prepared FST archive.
+//
+// A prepared archive (as written by ExportFar() when --prepared_far is set) is
+// an ordinary mappable archive whose rules are stored input-sorted, with the
+// properties used by the manager already computed and recorded in their
+// headers, alongside runtime artifacts which would otherwise be rebuilt by
+// every process loading it: currently, the label-lookahead form of rules with
+// input epsilons. The manifest, stored as a byte string FST under its own key,
+// lists the rules together with a fingerprint of each and the artifacts
+// stored for it. It is versioned and checksummed, so that archives written by
+// other versions, or damaged ones, are loaded as ordinary archives.
+
+#ifndef THRAX_PREPARED_FAR_H_
+#define THRAX_PREPARED_FAR_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fst/compat.h>
+#include <thrax/compat/compat.h>
+#include <fst/log.h>
+#include <fst/fst.h>
+#include <fst/vector-fst.h>
+#include <string_view>
+
+namespace thrax {
+
+inline constexpr char kPreparedFarManifestKey[] = "*PreparedFarManifest";
+
+// Key prefix of the label-lookahead form of a rule.
+inline constexpr char kPreparedLookAheadPrefix[] = "*LookAhead:";
+
+// Returns true if the archive key names a prepared artifact rather than a rule.
+inline bool IsPreparedArtifactKey(std::string_view key) {
+  return key == kPreparedFarManifestKey ||
+         key.substr(0, sizeof(kPreparedLookAheadPrefix) - 1) ==
+             kPreparedLookAheadPrefix;
+}
+
+// FNV-1a, which is all the checksums here need.
+inline uint64_t PreparedFarHash(std::string_view data,
+                                uint64_t hash = 0xcbf29ce484222325ULL) {
+  for (const unsigned char c : data) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Returns a fingerprint of the states, arcs and final weights of the FST.
+template <typename Arc>
+uint64_t FstFingerprint(const ::fst::Fst<Arc>& fst) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const auto add = [&hash](uint64_t value) {
+    hash = PreparedFarHash(
+        std::string_view(reinterpret_cast<const char*>(&value), sizeof(value)),
+        hash);
+  };
+  add(fst.Start());
+  for (::fst::StateIterator<::fst::Fst<Arc>> siter(fst); !siter.Done();
+       siter.Next()) {
+    const auto state = siter.Value();
+    add(fst.Final(state).Hash());
+    for (::fst::ArcIterator<::fst::Fst<Arc>> aiter(fst, state); !aiter.Done();
+         aiter.Next()) {
+      const auto& arc = aiter.Value();
+      add(arc.ilabel);
+      add(arc.olabel);
+      add(arc.weight.Hash());
+      add(arc.nextstate);
+    }
+    add(-1);
+  }
+  return hash;
+}
+
+struct PreparedFarManifest {
+  // Incremented whenever the layout of prepared archives changes.
+  static constexpr int kVersion = 1;
+
+  struct Rule {
+    std::string name;
+    uint64_t fingerprint = 0;
+    // Whether the archive holds the rule's label-lookahead form.
+    bool lookahead = false;
+  };
+
+  int version = kVersion;
+  // In key order.
+  std::vector<Rule> rules;
+
+  // Writes the manifest as lines of text, ending with a checksum of the rest.
+  std::string Serialize() const;
+
+  // Reads a serialized manifest, returning false if it is malformed, fails its
+  // checksum, or has a different version.
+  bool Parse(std::string_view text);
+
+  // Stores the manifest as an FST accepting its bytes, as archives only hold
+  // FSTs.
+  template <typename Arc>
+  std::unique_ptr<::fst::VectorFst<Arc>> ToFst() const;
+
+  // Reads a manifest stored by ToFst().
+  template <typename Arc>
+  bool FromFst(const ::fst::Fst<Arc>& fst);
+};
+
+inline std::string PreparedFarManifest::Serialize() const {
+  char buf[64];
+  std::string text = "thrax-prepared-far " + std::to_string(version) + "\n";
+  for (const auto& rule : rules) {
+    std::snprintf(buf, sizeof(buf), "\t%016llx\t%d\n",
+                  static_cast<unsigned long long>(rule.fingerprint),
+                  rule.lookahead ? 1 : 0);
+    text += rule.name;
+    text += buf;
+  }
+  std::snprintf(buf, sizeof(buf), "checksum %016llx\n",
+                static_cast<unsigned long long>(PreparedFarHash(text)));
+  return text + buf;
+}
+
+inline bool PreparedFarManifest::Parse(std::string_view text) {
+  rules.clear();
+  static constexpr std::string_view kChecksum = "checksum ";
+  const auto pos = text.rfind(kChecksum);
+  if (pos == std::string_view::npos) return false;
+  const std::string checksum(text.substr(pos + kChecksum.size()));
+  if (std::strtoull(checksum.c_str(), nullptr, 16) !=
+      PreparedFarHash(text.substr(0, pos))) {
+    return false;
+  }
+  text = text.substr(0, pos);
+  bool header = true;
+  while (!text.empty()) {
+    const auto end = text.find('\n');
+    if (end == std::string_view::npos) return false;
+    const std::string line(text.substr(0, end));
+    text.remove_prefix(end + 1);
+    if (header) {
+      static constexpr std::string_view kHeader = "thrax-prepared-far ";
+      if (line.compare(0, kHeader.size(), kHeader) != 0) return false;
+      version = std::atoi(line.c_str() + kHeader.size());
+      if (version != kVersion) return false;
+      header = false;
+      continue;
+    }
+    const auto tab1 = line.find('\t');
+    const auto tab2 = line.find('\t', tab1 + 1);
+    if (tab1 == std::string::npos || tab2 == std::string::npos) return false;
+    Rule rule;
+    rule.name = line.substr(0, tab1);
+    rule.fingerprint = std::strtoull(line.c_str() + tab1 + 1, nullptr, 16);
+    rule.lookahead = line.compare(tab2 + 1, std::string::npos, "1") == 0;
+    rules.push_back(std::move(rule));
+  }
+  return !header;
+}
+
+template <typename Arc>
+std::unique_ptr<::fst::VectorFst<Arc>> PreparedFarManifest::ToFst() const {
+  const auto text = Serialize();
+  auto fst = std::make_unique<::fst::VectorFst<Arc>>();
+  auto state = fst->AddState();
+  fst->SetStart(state);
+  for (const unsigned char c : text) {
+    const auto nextstate = fst->AddState();
+    fst->AddArc(state, Arc(c, c, nextstate));
+    state = nextstate;
+  }
+  fst->SetFinal(state);
+  return fst;
+}
+
+template <typename Arc>
+bool PreparedFarManifest::FromFst(const ::fst::Fst<Arc>& fst) {
+  std::string text;
+  auto state = fst.Start();
+  while (state != ::fst::kNoStateId &&
+         fst.Final(state) == Arc::Weight::Zero()) {
+    ::fst::ArcIterator<::fst::Fst<Arc>> aiter(fst, state);
+    if (aiter.Done()) return false;
+    const auto& arc = aiter.Value();
+    if (arc.ilabel <= 0 || arc.ilabel > 255) return false;
+    text.push_back(static_cast<char>(arc.ilabel));
+    state = arc.nextstate;
+  }
+  return state != ::fst::kNoStateId && Parse(text);
+}
+
+}  // namespace thrax
+
+#endif  // THRAX_PREPARED_FAR_H_
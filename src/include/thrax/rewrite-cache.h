@@ -0,0 +1,174 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A bounded, thread-safe cache of rewrite results, keyed by a string which
+// identifies both the rules and the input. Failed rewrites are cached as well
+// as successful ones. The cache is split into shards, each with its own lock
+// and least-recently-used eviction, so that concurrent lookups rarely contend.
+
+#ifndef THRAX_REWRITE_CACHE_H_
+#define THRAX_REWRITE_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <string_view>
+
+namespace thrax {
+
+class RewriteCache {
+ public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+  };
+
+  // The memory budget, in bytes, is divided evenly among the shards.
+  explicit RewriteCache(size_t max_bytes, size_t num_shards = 16)
+      : num_shards_(num_shards > 0 ? num_shards : 1),
+        shard_bytes_(max_bytes / num_shards_),
+        shards_(new Shard[num_shards_]) {}
+
+  // Returns true if the key is cached, in which case *success is set to the
+  // cached outcome and, if it was successful, the cached output is assigned to
+  // *output.
+  bool Lookup(std::string_view key, std::string* output, bool* success);
+
+  // Caches the outcome of a rewrite, evicting the least recently used entries
+  // of the shard as needed to stay within budget.
+  void Insert(std::string_view key, std::string_view output, bool success);
+
+  // Drops all entries; the counters are kept.
+  void Clear();
+
+  Stats GetStats() const;
+
+ private:
+  struct Entry {
+    std::string key;
+    std::string output;
+    bool success;
+  };
+
+  using EntryList = std::list<Entry>;
+
+  // Aligned to keep the locks of neighbouring shards off the same cache line.
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    // Most recently used first.
+    EntryList entries;
+    // Keys refer to the strings held by the entries.
+    std::unordered_map<std::string_view, EntryList::iterator> index;
+    size_t bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  // Approximate bookkeeping cost of an entry beyond its strings.
+  static constexpr size_t kEntryOverhead =
+      sizeof(Entry) + 4 * sizeof(void*) + sizeof(std::string_view);
+
+  static size_t EntryBytes(const Entry& entry) {
+    return kEntryOverhead + entry.key.capacity() + entry.output.capacity();
+  }
+
+  Shard* GetShard(std::string_view key) const {
+    const size_t hash = std::hash<std::string_view>()(key);
+    return &shards_[(hash ^ (hash >> (4 * sizeof(hash)))) % num_shards_];
+  }
+
+  const size_t num_shards_;
+  const size_t shard_bytes_;
+  const std::unique_ptr<Shard[]> shards_;
+
+  RewriteCache(const RewriteCache&) = delete;
+  RewriteCache& operator=(const RewriteCache&) = delete;
+};
+
+inline bool RewriteCache::Lookup(std::string_view key, std::string* output,
+                                 bool* success) {
+  auto* shard = GetShard(key);
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  const auto it = shard->index.find(key);
+  if (it == shard->index.end()) {
+    ++shard->misses;
+    return false;
+  }
+  ++shard->hits;
+  shard->entries.splice(shard->entries.begin(), shard->entries, it->second);
+  const auto& entry = *it->second;
+  *success = entry.success;
+  if (entry.success) output->assign(entry.output);
+  return true;
+}
+
+inline void RewriteCache::Insert(std::string_view key, std::string_view output,
+                                 bool success) {
+  auto* shard = GetShard(key);
+  Entry entry{std::string(key), std::string(output), success};
+  const auto bytes = EntryBytes(entry);
+  if (bytes > shard_bytes_) return;
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  // Another thread may have got here first.
+  if (shard->index.count(key)) return;
+  while (shard->bytes + bytes > shard_bytes_ && !shard->entries.empty()) {
+    const auto& last = shard->entries.back();
+    shard->bytes -= EntryBytes(last);
+    shard->index.erase(last.key);
+    shard->entries.pop_back();
+    ++shard->evictions;
+  }
+  shard->entries.push_front(std::move(entry));
+  const auto it = shard->entries.begin();
+  shard->index.emplace(it->key, it);
+  shard->bytes += bytes;
+}
+
+inline void RewriteCache::Clear() {
+  for (size_t i = 0; i < num_shards_; ++i) {
+    auto& shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.index.clear();
+    shard.entries.clear();
+    shard.bytes = 0;
+  }
+}
+
+inline RewriteCache::Stats RewriteCache::GetStats() const {
+  Stats stats;
+  for (size_t i = 0; i < num_shards_; ++i) {
+    auto& shard = shards_[i];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    stats.hits += shard.hits;
+    stats.misses += shard.misses;
+    stats.evictions += shard.evictions;
+    stats.entries += shard.entries.size();
+    stats.bytes += shard.bytes;
+  }
+  return stats;
+}
+
+}  // namespace thrax
+
+#endif  // THRAX_REWRITE_CACHE_H_
@@ -0,0 +1,243 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Runtime statistics for the rewrites through each rule or cascade of a
+// manager (see GrmManagerOptions::collect_rule_stats).
+//
+// Each thread records into its own shard, under a lock which is only ever
+// contended by readers, and the shards are merged when the statistics are
+// read. The shards are owned by the collector, and freed with it.
+
+#ifndef THRAX_RULE_STATS_H_
+#define THRAX_RULE_STATS_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <string_view>
+
+namespace thrax {
+
+struct RuleStats {
+  // Latency bucket i counts the rewrites taking less than 2^i microseconds
+  // (and at least 2^(i - 1)); the last bucket counts the rest.
+  static constexpr int kNumLatencyBuckets = 22;
+
+  uint64_t calls = 0;
+  uint64_t failures = 0;
+  uint64_t latency_ns = 0;
+  std::array<uint64_t, kNumLatencyBuckets> latency_buckets = {};
+  // The number of compositions performed (none for sequential rules and cache
+  // hits; one per stage for cascades), and the total number of states and
+  // arcs of the lattices they built.
+  uint64_t compositions = 0;
+  uint64_t lattice_states = 0;
+  uint64_t lattice_arcs = 0;
+  // The total size of the outputs of successful rewrites: bytes or labels for
+  // strings, and states for output lattices.
+  uint64_t output_size = 0;
+
+  void AddLatency(uint64_t ns) {
+    latency_ns += ns;
+    int bucket = 0;
+    for (auto us = ns / 1000; us > 0 && bucket + 1 < kNumLatencyBuckets;
+         us >>= 1) {
+      ++bucket;
+    }
+    ++latency_buckets[bucket];
+  }
+
+  void Merge(const RuleStats& other) {
+    calls += other.calls;
+    failures += other.failures;
+    latency_ns += other.latency_ns;
+    for (int i = 0; i < kNumLatencyBuckets; ++i) {
+      latency_buckets[i] += other.latency_buckets[i];
+    }
+    compositions += other.compositions;
+    lattice_states += other.lattice_states;
+    lattice_arcs += other.lattice_arcs;
+    output_size += other.output_size;
+  }
+};
+
+using RuleStatsMap = std::map<std::string, RuleStats, std::less<>>;
+
+class RuleStatsCollector {
+ public:
+  RuleStatsCollector() {
+    static std::atomic<uint64_t> next_id(0);
+    id_ = next_id.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Adds the sample to the statistics of the named rule, in the calling
+  // thread's shard.
+  void Add(std::string_view name, const RuleStats& sample) {
+    auto& shard = LocalShard();
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.stats.find(name);
+    if (it == shard.stats.end()) {
+      it = shard.stats.emplace(std::string(name), RuleStats()).first;
+    }
+    it->second.Merge(sample);
+  }
+
+  // Returns the statistics of all threads, merged.
+  RuleStatsMap Get() const {
+    RuleStatsMap merged;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> shard_lock(shard->mutex);
+      for (const auto& [name, stats] : shard->stats) merged[name].Merge(stats);
+    }
+    return merged;
+  }
+
+  void Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& shard : shards_) {
+      std::lock_guard<std::mutex> shard_lock(shard->mutex);
+      shard->stats.clear();
+    }
+  }
+
+ private:
+  struct Shard {
+    std::mutex mutex;
+    RuleStatsMap stats;
+  };
+
+  // A thread's reference to its shard of a collector, by collector ID. The
+  // weak reference tells when the collector, and so the shard, is gone.
+  struct LocalShardRef {
+    uint64_t id;
+    std::weak_ptr<Shard> owner;
+    Shard* shard;
+  };
+
+  // Returns the calling thread's shard, registering it on first use. A shard
+  // outlives its thread, so that its statistics are not lost; a thread's
+  // references to the shards of destroyed collectors are dropped the next
+  // time it registers one.
+  Shard& LocalShard() {
+    static thread_local std::vector<LocalShardRef> local_shards;
+    for (const auto& ref : local_shards) {
+      if (ref.id == id_) return *ref.shard;
+    }
+    local_shards.erase(
+        std::remove_if(local_shards.begin(), local_shards.end(),
+                       [](const LocalShardRef& ref) {
+                         return ref.owner.expired();
+                       }),
+        local_shards.end());
+    auto shard = std::make_shared<Shard>();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      shards_.push_back(shard);
+    }
+    local_shards.push_back({id_, shard, shard.get()});
+    return *shard;
+  }
+
+  uint64_t id_;
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<Shard>> shards_;
+
+  RuleStatsCollector(const RuleStatsCollector&) = delete;
+  RuleStatsCollector& operator=(const RuleStatsCollector&) = delete;
+};
+
+namespace internal {
+
+// Escapes a Prometheus label value.
+inline std::string EscapeLabelValue(std::string_view value) {
+  std::string escaped;
+  for (const char c : value) {
+    if (c == '\\' || c == '"') {
+      escaped.push_back('\\');
+      escaped.push_back(c);
+    } else if (c == '\n') {
+      escaped.append("\\n");
+    } else {
+      escaped.push_back(c);
+    }
+  }
+  return escaped;
+}
+
+}  // namespace internal
+
+// Writes the statistics in the Prometheus text exposition format, as metrics
+// whose names begin with the prefix, labeled by rule.
+inline std::string RuleStatsToPrometheus(const RuleStatsMap& stats,
+                                         std::string_view prefix =
+                                             "thrax_rule") {
+  std::string text;
+  const std::string base(prefix);
+  const auto counter = [&](const char* name, const char* help,
+                           uint64_t RuleStats::*field) {
+    text += "# HELP " + base + "_" + name + " " + help + "\n";
+    text += "# TYPE " + base + "_" + name + " counter\n";
+    for (const auto& [rule, rule_stats] : stats) {
+      text += base + "_" + name + "{rule=\"" +
+              internal::EscapeLabelValue(rule) + "\"} " +
+              std::to_string(rule_stats.*field) + "\n";
+    }
+  };
+  counter("calls_total", "Rewrites attempted.", &RuleStats::calls);
+  counter("failures_total", "Rewrites which failed.", &RuleStats::failures);
+  counter("compositions_total", "Compositions performed.",
+          &RuleStats::compositions);
+  counter("lattice_states_total", "States of the composed lattices.",
+          &RuleStats::lattice_states);
+  counter("lattice_arcs_total", "Arcs of the composed lattices.",
+          &RuleStats::lattice_arcs);
+  counter("output_size_total", "Size of the outputs of successful rewrites.",
+          &RuleStats::output_size);
+  const auto latency = base + "_latency_seconds";
+  text += "# HELP " + latency + " Rewrite latency.\n";
+  text += "# TYPE " + latency + " histogram\n";
+  char buf[32];
+  for (const auto& [rule, rule_stats] : stats) {
+    const auto label = "rule=\"" + internal::EscapeLabelValue(rule) + "\"";
+    uint64_t cumulative = 0;
+    for (int i = 0; i + 1 < RuleStats::kNumLatencyBuckets; ++i) {
+      cumulative += rule_stats.latency_buckets[i];
+      std::snprintf(buf, sizeof(buf), "%g", (1ULL << i) * 1e-6);
+      text += latency + "_bucket{" + label + ",le=\"" + buf + "\"} " +
+              std::to_string(cumulative) + "\n";
+    }
+    text += latency + "_bucket{" + label + ",le=\"+Inf\"} " +
+            std::to_string(rule_stats.calls) + "\n";
+    std::snprintf(buf, sizeof(buf), "%.9f", rule_stats.latency_ns * 1e-9);
+    text += latency + "_sum{" + label + "} " + buf + "\n";
+    text += latency + "_count{" + label + "} " +
+            std::to_string(rule_stats.calls) + "\n";
+  }
+  return text;
+}
+
+}  // namespace thrax
+
+#endif  // THRAX_RULE_STATS_H_
@@ -0,0 +1,148 @@
+// Copyright 2005-2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// A pool of immutable symbol tables, deduplicated by their labeled checksums.
+//
+// Rules exported with --save_symbols each carry their own copy of the byte or
+// UTF-8 symbol table, so reading an archive allocates one table per rule.
+// Copies of a SymbolTable share its implementation, including the cached
+// checksums, so rules whose tables are replaced by copies of pooled ones share
+// a single table in memory, and CompatSymbols() computes the checksum of each
+// distinct table once rather than once for each rule.
+//
+// The pool only refers weakly to its tables. They are kept alive by
+// SymbolTableRefs, which each set of rules sharing them (such as a generation
+// of a GrmManager) holds, and are dropped from the pool once no set holds
+// them.
+
+#ifndef THRAX_SYMBOL_TABLE_POOL_H_
+#define THRAX_SYMBOL_TABLE_POOL_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fst/compat.h>
+#include <thrax/compat/compat.h>
+#include <fst/mutable-fst.h>
+#include <fst/symbol-table.h>
+
+namespace thrax {
+
+// References to the pooled tables used by a set of FSTs, keeping them in the
+// pool. This may be added to concurrently.
+class SymbolTableRefs {
+ public:
+  SymbolTableRefs() = default;
+
+  void Add(std::shared_ptr<const ::fst::SymbolTable> table) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (std::find(tables_.begin(), tables_.end(), table) == tables_.end()) {
+      tables_.push_back(std::move(table));
+    }
+  }
+
+  // Adds the other set's references, as when its FSTs are copied.
+  void Add(const SymbolTableRefs& other) {
+    std::vector<std::shared_ptr<const ::fst::SymbolTable>> tables;
+    {
+      std::lock_guard<std::mutex> lock(other.mutex_);
+      tables = other.tables_;
+    }
+    for (auto& table : tables) Add(std::move(table));
+  }
+
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return tables_.size();
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  // Sets of rules only use a handful of distinct tables.
+  std::vector<std::shared_ptr<const ::fst::SymbolTable>> tables_;
+
+  SymbolTableRefs(const SymbolTableRefs&) = delete;
+  SymbolTableRefs& operator=(const SymbolTableRefs&) = delete;
+};
+
+class SymbolTablePool {
+ public:
+  SymbolTablePool() = default;
+
+  // Returns the pooled table with the same labeled checksum as the given one,
+  // adding a copy of it if there is none. The returned table is never
+  // modified, and stays in the pool for as long as references to it are held.
+  // This may be called concurrently.
+  std::shared_ptr<const ::fst::SymbolTable> Intern(
+      const ::fst::SymbolTable& syms) {
+    // The checksum is computed outside the lock, and cached by the table.
+    const auto& checksum = syms.LabeledCheckSum();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = tables_[checksum];
+    if (auto table = entry.lock()) return table;
+    std::shared_ptr<const ::fst::SymbolTable> table(syms.Copy());
+    entry = table;
+    // Tables are only added when a grammar is loaded, so the pool is pruned
+    // then.
+    for (auto it = tables_.begin(); it != tables_.end();) {
+      if (it->second.expired()) {
+        it = tables_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    return table;
+  }
+
+  // Replaces the FST's symbol tables by copies of pooled ones, adding
+  // references to them to the set.
+  template <typename Arc>
+  void Intern(::fst::MutableFst<Arc>* fst, SymbolTableRefs* refs) {
+    if (const auto* isyms = fst->InputSymbols()) {
+      auto table = Intern(*isyms);
+      fst->SetInputSymbols(table.get());
+      refs->Add(std::move(table));
+    }
+    if (const auto* osyms = fst->OutputSymbols()) {
+      auto table = Intern(*osyms);
+      fst->SetOutputSymbols(table.get());
+      refs->Add(std::move(table));
+    }
+  }
+
+  // The number of tables still referred to.
+  size_t Size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::count_if(tables_.begin(), tables_.end(), [](const auto& entry) {
+      return !entry.second.expired();
+    });
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, std::weak_ptr<const ::fst::SymbolTable>>
+      tables_;
+
+  SymbolTablePool(const SymbolTablePool&) = delete;
+  SymbolTablePool& operator=(const SymbolTablePool&) = delete;
+};
+
+}  // namespace thrax
+
+#endif  // THRAX_SYMBOL_TABLE_POOL_H_
@@ -21,5 +21,13 @@
 DEFINE_bool(save_symbols, false,
             "Keep symbol tables associated with generated fsts.");
 
+DEFINE_bool(mappable_far, false,
+            "Write rules as aligned ConstFsts which can be memory-mapped when "
+            "the archive is loaded.");
+DEFINE_bool(prepared_far, false,
+            "Write a mappable archive which also stores the runtime artifacts "
+            "of its rules (such as their label-lookahead forms), listed in a "
+            "versioned, checksummed manifest.");
+
 DEFINE_string(indir, "", "The directory with the source files.");
 DEFINE_string(outdir, "", "The directory in which we'll write the output.");